@@ -0,0 +1,242 @@
+/**********************************************************************
+    bench_launch.c
+
+    End-to-end launch benchmarks. Starts smallsh in batch mode on a
+    pipe, sends it commands and times the replies:
+
+        launch_fg        "/bin/true" then "status", per round trip
+        redirect_in      "/bin/true < /dev/null" then "status"
+        redirect_out     "/bin/true > /dev/null" then "status"
+        copy_cat         "cat < FILE > /dev/null", copied by the shell
+        copy_exec        "/bin/cat < FILE > /dev/null", a real child
+        echo_fast        "echo hi > /dev/null", run in the shell
+        echo_exec        "/bin/echo hi > /dev/null", a real child
+        test_fast        "[ -d /tmp ]", run in the shell
+        lines4           "/bin/true" on four lines, then "status"
+        list4            "/bin/true && ..." (four), then "status"
+        launch_bg        N x "true &", then "wait" and "status"
+        exit_jobs        100 x "sleep 100 &", then "exit" until the shell ends
+
+    The launch cases name /bin/true, since a bare "true" (like echo
+    and test) runs inside the shell without launching anything.
+
+    Each command is followed by the status builtin, whose output line
+    marks completion. Round-trip cases report p50/p99/mean in
+    microseconds; the background case reports launches per second.
+    Results are printed as one JSON object per line and every case is
+    run once per launch backend.
+
+    FILE is a 64 KiB temporary file made by main.
+
+    The background case queues all its commands before reading any
+    replies, so keep iterations low enough (a few thousand) for them to
+    fit in the pipe.
+
+    Usage: bench_launch [path/to/smallsh] [iterations]
+************************************************************************/
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+typedef struct {
+    pid_t pid;
+    FILE *in;
+    FILE *out;
+} Shell;
+
+/**********************************************************************
+    Function: nowUs()
+    Monotonic clock in microseconds.
+************************************************************************/
+static double nowUs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**********************************************************************
+    Function: startShell(Shell *sh, path, backend)
+    Runs "smallsh --launch=backend" with its stdin and stdout on pipes.
+************************************************************************/
+static void startShell(Shell *sh, char *path, char *backend){
+    int toShell[2], fromShell[2];
+    char option[32];
+    char *argv[] = { path, option, NULL };
+    posix_spawn_file_actions_t actions;
+
+    snprintf(option, sizeof(option), "--launch=%s", backend);
+    if (pipe(toShell) == -1 || pipe(fromShell) == -1){
+        perror("pipe()");
+        exit(EXIT_FAILURE);
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, toShell[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fromShell[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, toShell[1]);
+    posix_spawn_file_actions_addclose(&actions, fromShell[0]);
+    if (posix_spawn(&sh->pid, path, &actions, NULL, argv, environ) != 0){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(toShell[0]);
+    close(fromShell[1]);
+    sh->in = fdopen(toShell[1], "w");
+    sh->out = fdopen(fromShell[0], "r");
+}
+
+/**********************************************************************
+    Function: stopShell(Shell *sh)
+************************************************************************/
+static void stopShell(Shell *sh){
+    fprintf(sh->in, "exit\n");
+    fclose(sh->in);
+    fclose(sh->out);
+    waitpid(sh->pid, NULL, 0);
+}
+
+/**********************************************************************
+    Function: roundTrip(Shell *sh, const char *command)
+
+    Sends command followed by "status" and waits for the status line.
+
+    Returns:
+        Elapsed microseconds.
+************************************************************************/
+static double roundTrip(Shell *sh, const char *command){
+    char line[512];
+    double start = nowUs();
+
+    fprintf(sh->in, "%s\nstatus\n", command);
+    fflush(sh->in);
+    while (fgets(line, sizeof(line), sh->out) != NULL){
+        if (strstr(line, "Last foreground process") != NULL || strstr(line, "received a signal") != NULL){
+            break;
+        }
+    }
+    return nowUs() - start;
+}
+
+static int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+    Function: latencyCase(name, backend, path, command, iterations)
+    Times iterations round trips of command and prints percentiles.
+************************************************************************/
+static void latencyCase(const char *name, char *backend, char *path, const char *command, int iterations){
+    Shell sh;
+    double *samples = malloc(iterations * sizeof(double));
+    double total = 0;
+
+    startShell(&sh, path, backend);
+
+    // Warm up the shell and its command cache.
+    for (int i = 0; i < 20; i++){
+        roundTrip(&sh, command);
+    }
+    for (int i = 0; i < iterations; i++){
+        samples[i] = roundTrip(&sh, command);
+        total += samples[i];
+    }
+    stopShell(&sh);
+
+    qsort(samples, iterations, sizeof(double), compareDoubles);
+    printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"iterations\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"mean_us\":%.1f}\n",
+            name, backend, iterations, samples[iterations / 2], samples[(int)(iterations * 0.99)], total / iterations);
+    fflush(stdout);
+    free(samples);
+}
+
+/**********************************************************************
+    Function: backgroundCase(backend, path, count)
+    Launches count background "true" jobs and waits for all of them.
+************************************************************************/
+static void backgroundCase(char *backend, char *path, int count){
+    Shell sh;
+    double start, elapsed;
+
+    startShell(&sh, path, backend);
+    roundTrip(&sh, "true");
+
+    start = nowUs();
+    for (int i = 0; i < count; i++){
+        fputs("true &\n", sh.in);
+    }
+    roundTrip(&sh, "wait");
+    elapsed = nowUs() - start;
+    stopShell(&sh);
+
+    printf("{\"bench\":\"launch_bg\",\"backend\":\"%s\",\"jobs\":%d,\"total_ms\":%.1f,\"launches_per_sec\":%.0f}\n",
+            backend, count, elapsed / 1e3, count / (elapsed / 1e6));
+    fflush(stdout);
+}
+
+/**********************************************************************
+    Function: exitCase(backend, path, count)
+    Starts count long background jobs and times exit ending them.
+************************************************************************/
+static void exitCase(char *backend, char *path, int count){
+    Shell sh;
+    double start, elapsed;
+
+    startShell(&sh, path, backend);
+    for (int i = 0; i < count; i++){
+        fputs("sleep 100 &\n", sh.in);
+    }
+    roundTrip(&sh, "true");
+
+    start = nowUs();
+    stopShell(&sh);
+    elapsed = nowUs() - start;
+
+    printf("{\"bench\":\"exit_jobs\",\"backend\":\"%s\",\"jobs\":%d,\"total_ms\":%.1f}\n",
+            backend, count, elapsed / 1e3);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+    char *path = argc > 1 ? argv[1] : "./smallsh";
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+    char *backends[] = { "spawn", "fork", "zygote" };
+    char file[] = "/tmp/bench_launch.XXXXXX";
+    char copyCat[64], copyExec[64];
+    static char block[65536];
+    int fd = mkstemp(file);
+
+    if (fd == -1 || write(fd, block, sizeof(block)) != sizeof(block)){
+        perror(file);
+        return 1;
+    }
+    close(fd);
+    snprintf(copyCat, sizeof(copyCat), "cat < %s > /dev/null", file);
+    snprintf(copyExec, sizeof(copyExec), "/bin/cat < %s > /dev/null", file);
+
+    for (int b = 0; b < 3; b++){
+        latencyCase("launch_fg", backends[b], path, "/bin/true", iterations);
+        latencyCase("redirect_in", backends[b], path, "/bin/true < /dev/null", iterations);
+        latencyCase("redirect_out", backends[b], path, "/bin/true > /dev/null", iterations);
+        latencyCase("copy_cat", backends[b], path, copyCat, iterations);
+        latencyCase("copy_exec", backends[b], path, copyExec, iterations);
+        latencyCase("echo_fast", backends[b], path, "echo hi > /dev/null", iterations);
+        latencyCase("echo_exec", backends[b], path, "/bin/echo hi > /dev/null", iterations);
+        latencyCase("test_fast", backends[b], path, "[ -d /tmp ]", iterations);
+        latencyCase("lines4", backends[b], path, "/bin/true\n/bin/true\n/bin/true\n/bin/true", iterations);
+        latencyCase("list4", backends[b], path, "/bin/true && /bin/true && /bin/true && /bin/true", iterations);
+        backgroundCase(backends[b], path, iterations);
+        exitCase(backends[b], path, 100);
+    }
+    unlink(file);
+    return 0;
+}
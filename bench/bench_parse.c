@@ -0,0 +1,138 @@
+/**********************************************************************
+    bench_parse.c
+
+    Microbenchmarks for smallsh's parseCommand. smallsh.c is compiled
+    into this file with its main renamed, so the parser under test is
+    exactly the one the shell runs.
+
+    Each case parses the same line repeatedly for about half a second
+    and prints one JSON object per line:
+        {"bench":"parse_plain","lines":N,"tokens":N,"ns_per_line":X,
+         "tokens_per_sec":X}
+
+    parse_many_args, parse_args_5k and parse_args_50k differ only in
+    length, so equal tokens_per_sec means parsing scales linearly.
+
+    The trace_event cases time the TRACE() hook with tracing off and
+    on.
+
+    Usage: bench_parse [seconds_per_case]
+************************************************************************/
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+typedef struct {
+    const char *name;
+    char *line;
+} ParseCase;
+
+/**********************************************************************
+    Function: nowNs()
+    Monotonic clock in nanoseconds.
+************************************************************************/
+static double nowNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**********************************************************************
+    Function: repeatWords(word, count)
+    Builds "word word word ..." with count copies.
+************************************************************************/
+static char *repeatWords(const char *word, int count){
+    size_t wordLen = strlen(word);
+    char *line = malloc(count * (wordLen + 1) + 1);
+    char *pos = line;
+
+    for (int i = 0; i < count; i++){
+        memcpy(pos, word, wordLen);
+        pos += wordLen;
+        *pos++ = ' ';
+    }
+    *pos = '\0';
+    return line;
+}
+
+/**********************************************************************
+    Function: runCase(ParseCase *pc, double seconds)
+
+    Parses pc->line until the time budget is spent. Each iteration
+    parses a fresh copy of the line, so results stay comparable with
+    the earlier strtok parser that tokenised in place; the copy is
+    part of the measured cost.
+************************************************************************/
+static void runCase(ParseCase *pc, double seconds){
+    Command cmd = {};
+    size_t lineLen = strlen(pc->line);
+    char *scratch = malloc(lineLen + 1);
+    long lines = 0;
+    long tokens = 0;
+    double start = nowNs();
+    double elapsed;
+
+    do {
+        for (int i = 0; i < 256; i++){
+            memcpy(scratch, pc->line, lineLen + 1);
+            resetCommand(&cmd);
+            parseCommand(scratch, &cmd);
+            tokens += cmd.argc;
+        }
+        lines += 256;
+        elapsed = nowNs() - start;
+    } while (elapsed < seconds * 1e9);
+
+    printf("{\"bench\":\"%s\",\"lines\":%ld,\"tokens\":%ld,\"ns_per_line\":%.1f,\"tokens_per_sec\":%.0f}\n",
+            pc->name, lines, tokens, elapsed / lines, tokens / (elapsed / 1e9));
+    free(scratch);
+}
+
+/**********************************************************************
+    Function: traceCase(bool enabled, double seconds)
+
+    Times TRACE() calls with tracing off, and on with the flusher
+    writing to /dev/null.
+************************************************************************/
+static void traceCase(bool enabled, double seconds){
+    long events = 0;
+    double start, elapsed;
+
+    if (enabled && openTrace("/dev/null") == -1){
+        return;
+    }
+    start = nowNs();
+    do {
+        for (int i = 0; i < 256; i++){
+            TRACE(TRACE_PARSE, 0, i);
+        }
+        events += 256;
+        elapsed = nowNs() - start;
+    } while (elapsed < seconds * 1e9);
+    stopTrace();
+
+    printf("{\"bench\":\"trace_event\",\"enabled\":%s,\"events\":%ld,\"ns_per_event\":%.2f}\n",
+            enabled ? "true" : "false", events, elapsed / events);
+}
+
+int main(int argc, char *argv[]){
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+
+    cachePidString();
+    ParseCase cases[] = {
+        { "parse_simple", strdup("ls -al /tmp") },
+        { "parse_redirects", strdup("sort -k2 -n < input.txt > output.txt &") },
+        { "parse_pipeline", strdup("cat access.log | grep GET | cut -d ' ' -f1 | sort | uniq -c | sort -rn") },
+        { "parse_many_args", repeatWords("file_name.txt", 500) },
+        { "parse_args_5k", repeatWords("file_name.txt", 5000) },
+        { "parse_args_50k", repeatWords("file_name.txt", 50000) },
+        { "parse_pid_expansion", repeatWords("tmp$$/out$$.$$", 200) },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+        runCase(&cases[i], seconds);
+    }
+    traceCase(false, seconds);
+    traceCase(true, seconds);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/**********************************************************************
+    bench_serve.c
+
+    Benchmarks smallsh's server mode against starting a shell per
+    request:
+
+        serve              C clients connected to "smallsh --serve",
+                           each keeping one "true" request in flight,
+                           until N requests have been answered
+        shell_per_request  a new "smallsh" per request, fed "true" on
+                           a pipe and waited for
+
+    Reports requests per second and p50/p99 request latency in
+    microseconds, as one JSON object per line.
+
+    Usage: bench_serve [path/to/smallsh] [requests] [clients]
+************************************************************************/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/**********************************************************************
+    Function: nowUs()
+    Monotonic clock in microseconds.
+************************************************************************/
+static double nowUs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+    Function: report(name, clients, latencies, count, elapsed)
+    Prints one result line.
+************************************************************************/
+static void report(const char *name, int clients, double *latencies, int count, double elapsed){
+    qsort(latencies, count, sizeof(double), compareDoubles);
+    printf("{\"bench\":\"%s\",\"clients\":%d,\"requests\":%d,\"requests_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+            name, clients, count, count / (elapsed / 1e6), latencies[count / 2], latencies[count * 99 / 100]);
+    fflush(stdout);
+}
+
+/**********************************************************************
+    Function: connectServer(const char *path)
+    Connects to the server, retrying while it starts up.
+************************************************************************/
+static int connectServer(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    for (int tries = 0; tries < 200; tries++){
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0){
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    perror(path);
+    exit(EXIT_FAILURE);
+}
+
+/**********************************************************************
+    Function: serveCase(char *path, int requests, int clients)
+************************************************************************/
+static void serveCase(char *path, int requests, int clients){
+    char sock[64];
+    char *argv[] = { path, "--serve", sock, NULL };
+    struct pollfd *fds = calloc(clients, sizeof(struct pollfd));
+    double *sentAt = calloc(clients, sizeof(double));
+    double *latencies = calloc(requests, sizeof(double));
+    int sent = 0, done = 0;
+    double start;
+    char reply[64];
+    pid_t pid;
+
+    snprintf(sock, sizeof(sock), "/tmp/bench_serve.%d", getpid());
+    if (posix_spawn(&pid, path, NULL, NULL, argv, environ) != 0){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < clients; i++){
+        fds[i].fd = connectServer(sock);
+        fds[i].events = POLLIN;
+    }
+
+    start = nowUs();
+    for (int i = 0; i < clients && sent < requests; i++, sent++){
+        sentAt[i] = nowUs();
+        write(fds[i].fd, "true\n", 5);
+    }
+    while (done < requests){
+        poll(fds, clients, -1);
+        for (int i = 0; i < clients; i++){
+            if (!(fds[i].revents & POLLIN)){
+                continue;
+            }
+            if (read(fds[i].fd, reply, sizeof(reply)) <= 0){
+                fprintf(stderr, "bench_serve: server closed the connection\n");
+                exit(EXIT_FAILURE);
+            }
+            latencies[done++] = nowUs() - sentAt[i];
+            if (sent < requests){
+                sentAt[i] = nowUs();
+                write(fds[i].fd, "true\n", 5);
+                sent++;
+            }
+        }
+    }
+    report("serve", clients, latencies, requests, nowUs() - start);
+
+    for (int i = 0; i < clients; i++){
+        close(fds[i].fd);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(fds);
+    free(sentAt);
+    free(latencies);
+}
+
+/**********************************************************************
+    Function: shellCase(char *path, int requests)
+************************************************************************/
+static void shellCase(char *path, int requests){
+    char *argv[] = { path, NULL };
+    double *latencies = calloc(requests, sizeof(double));
+    double start = nowUs();
+    posix_spawn_file_actions_t actions;
+
+    for (int i = 0; i < requests; i++){
+        int input[2];
+        pid_t pid;
+        double began = nowUs();
+
+        if (pipe(input) == -1){
+            perror("pipe()");
+            exit(EXIT_FAILURE);
+        }
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, input[1]);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        if (posix_spawn(&pid, path, &actions, NULL, argv, environ) != 0){
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        close(input[0]);
+        write(input[1], "true\n", 5);
+        close(input[1]);
+        waitpid(pid, NULL, 0);
+        latencies[i] = nowUs() - began;
+    }
+    report("shell_per_request", 1, latencies, requests, nowUs() - start);
+    free(latencies);
+}
+
+int main(int argc, char *argv[]){
+    char *path = argc > 1 ? argv[1] : "./smallsh";
+    int requests = argc > 2 ? atoi(argv[2]) : 5000;
+    int clients = argc > 3 ? atoi(argv[3]) : 8;
+
+    serveCase(path, requests, 1);
+    serveCase(path, requests, clients);
+    shellCase(path, requests / 10);
+    return 0;
+}
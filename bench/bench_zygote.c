@@ -0,0 +1,90 @@
+/**********************************************************************
+    bench_zygote.c
+
+    Launch latency against the shell's resident size. smallsh.c is
+    compiled into this file with its main renamed, and the benchmark
+    plays the shell: it grows its heap to each size in turn (touching
+    every page) and times launchStage("true") plus the wait4 for it,
+    once per launch backend. The zygote is started before any memory
+    is added, as the shell does.
+
+    Prints one JSON object per line:
+        {"bench":"launch_rss","backend":"fork","rss_mb":N,
+         "p50_us":X,"p99_us":X}
+
+    Usage: bench_zygote [iterations]
+************************************************************************/
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+/**********************************************************************
+    Function: nowUs()
+    Monotonic clock in microseconds.
+************************************************************************/
+static double nowUs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+    Function: launchCase(backend, name, rssMB, iterations)
+    Times launching and reaping "true" with one backend.
+************************************************************************/
+static void launchCase(LaunchBackend backend, const char *name, int rssMB, int iterations){
+    char *argv[] = { "true", NULL };
+    double *latencies = calloc(iterations, sizeof(double));
+    int wstatus;
+
+    launch_backend = backend;
+    for (int i = 0; i < iterations; i++){
+        double began = nowUs();
+        pid_t pid = launchStage(argv, -1, -1, -1, false, NULL);
+
+        if (pid == -1 || waitpid(pid, &wstatus, 0) != pid){
+            fprintf(stderr, "bench_zygote: launch failed\n");
+            exit(EXIT_FAILURE);
+        }
+        latencies[i] = nowUs() - began;
+    }
+    qsort(latencies, iterations, sizeof(double), compareDoubles);
+    printf("{\"bench\":\"launch_rss\",\"backend\":\"%s\",\"rss_mb\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+            name, rssMB, latencies[iterations / 2], latencies[iterations * 99 / 100]);
+    fflush(stdout);
+    free(latencies);
+}
+
+int main(int argc, char *argv[]){
+    int iterations;
+    int sizes[] = { 0, 64, 256, 1024 };
+    int grown = 0;
+
+    // Case -> Re-executed by startZygote()
+    if (argc == 2 && strcmp(argv[1], "--zygote") == 0){
+        return smallsh_main(argc, argv);
+    }
+    iterations = argc > 1 ? atoi(argv[1]) : 500;
+
+    if (startZygote() == -1){
+        return 1;
+    }
+    for (int s = 0; s < 4; s++){
+        size_t extra = (size_t)(sizes[s] - grown) << 20;
+
+        if (extra > 0){
+            memset(malloc(extra), 1, extra);
+            grown = sizes[s];
+        }
+        launchCase(LAUNCH_SPAWN, "spawn", sizes[s], iterations);
+        launchCase(LAUNCH_FORK, "fork", sizes[s], iterations);
+        launchCase(LAUNCH_ZYGOTE, "zygote", sizes[s], iterations);
+    }
+    stopZygote();
+    return 0;
+}
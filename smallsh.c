@@ -1,6 +1,24 @@
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <termios.h>
+#include <dirent.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,273 +28,6379 @@
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <pthread.h>
 
-#define MAX_ARGS 512
-#define MAX_PIDS 512
-#define MAX_ARG_LEN 2048
 #define MAX_PID_LEN 6
+#define ARENA_MIN_SIZE 256
+#define ARGV_MIN_SIZE 16
+#define READ_BUFFER_SIZE 65536
+#define ARG_STRLEN_PAGES 32
+#define HISTORY_SIZE (16 << 20)
+#define HISTORY_DATA_OFFSET 4096
+#define HISTORY_WRAP UINT64_MAX
+#define HISTORY_STALL_NS 1000000000ULL
+#define COPY_CHUNK (1 << 30)
+#define ZYGOTE_FD 3
+#define ZYGOTE_MAX_REQUEST 65536
+#define TRACE_EVENTS 65536
+#define TRACE_FLUSH_US 10000
+
+
+/*---------------------------------------------------------------------
+ Per-job limits from the "limit" and "pin" prefixes (see parseLimits).
+ The forked child applies them before exec (applyLimits), so a command
+ with any limit set always goes through forkStage.
+
+ rlimits holds up to three RLIMIT_AS/RLIMIT_CPU/RLIMIT_NOFILE values,
+ set as both the soft and the hard limit. memoryMax and cpuMax are the
+ cgroup v2 memory.max and cpu.max texts, NULL if unset; when either is
+ given, cgroup is the job's own cgroup directory, made before launch
+ and removed once the job is over, otherwise "".
+----------------------------------------------------------------------*/
+typedef struct {
+    bool active;
+    bool pinned;
+    cpu_set_t cpus;
+    bool niced;
+    int nice;
+    struct {
+        int resource;
+        rlim_t value;
+    } rlimits[3];
+    int nrlimits;
+    char *memoryMax;
+    char *cpuMax;
+    char cgroup[PATH_MAX];
+} JobLimits;
+
+/*---------------------------------------------------------------------
+ A parsed command line.
+
+ Token text lives in a single growable byte arena (text) and argv
+ points into it, so a short command only touches a few hundred bytes.
+ The struct is reused across prompt iterations: resetCommand() rewinds
+ the arena without freeing it, and argv is NULL-terminated for execvp.
+
+ A pipeline ("a | b | c") keeps every stage in the same argv vector,
+ each stage ending in its own NULL. stages[i] is the index in argv
+ where stage i starts, and pids[i] is filled in when it is launched.
+ The input redirect applies to the first stage, the output redirect
+ to the last. limits applies to every stage; it is filled in when the
+ pipeline is launched.
+----------------------------------------------------------------------*/
+typedef struct {
+    char *text;
+    size_t textLen;
+    size_t textCap;
+    char **argv;
+    int argc;
+    int argvCap;
+    int *stages;
+    pid_t *pids;
+    int nstages;
+    int stagesCap;
+    char *redir_path_in;
+    char *redir_path_out;
+    bool background;
+    JobLimits limits;
+} Command;
+
+/*---------------------------------------------------------------------
+ Resource accounting for a job, from wait4(). CPU times and fault
+ counts are summed over every process of a pipeline; ru_maxrss is the
+ largest single process. started/finished are CLOCK_MONOTONIC.
+----------------------------------------------------------------------*/
+typedef struct {
+    struct timespec started;
+    struct timespec finished;
+    struct rusage usage;
+} Usage;
+
+/*---------------------------------------------------------------------
+ A command list ("a && b || c ; d"). The line is split once at its
+ top-level ;, && and || into a flat node array, kept and reused from
+ line to line, over a copy of the line with a NUL in place of each
+ operator. op is the operator after the node, LIST_END for the last.
+ A node is parsed only when it is reached, so "$?" in it sees the
+ status of the command before it; next is the node to consider next.
+----------------------------------------------------------------------*/
+typedef enum {
+    LIST_END,
+    LIST_SEQ,
+    LIST_AND,
+    LIST_OR
+} ListOp;
+
+typedef struct {
+    int start;
+    ListOp op;
+} ListNode;
+
+typedef struct {
+    char *text;
+    size_t textCap;
+    ListNode *nodes;
+    int nnodes;
+    int nodesCap;
+    int next;
+} CommandList;
+
+/*---------------------------------------------------------------------
+ One of the parallel builtin's N workers. A worker takes a job line,
+ splits it into a list and runs its commands one at a time, as the
+ shell does; running is set while the current command is a job in
+ the table (whose owner is the worker's index). status is the wait
+ status of the list's last command, cmdline the line for messages.
+----------------------------------------------------------------------*/
+typedef struct {
+    CommandList list;
+    char *cmdline;
+    int status;
+    bool running;
+} ParallelWorker;
+
+/*---------------------------------------------------------------------
+ Background job table.
+
+ Jobs live in a growable array indexed by job number - 1, and free
+ slots are chained through nextFree, so adding and removing a job is
+ O(1) however many are running. slots is an open-addressing hash from
+ each child pid to the index of its job, so a reaped pid finds its
+ job without a scan. A pipeline is one job with one pid per stage.
+ pooled marks jobs started by the parallel builtin, which collects
+ them itself instead of announcing each one. owner is the server
+ client that started the job, the parallel worker for a pooled job,
+ or -1. cgroup is the job's cgroup directory from "limit mem=/cpumax=",
+ removed with the job, or NULL.
+----------------------------------------------------------------------*/
+typedef enum {
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+typedef struct {
+    int id;
+    JobState state;
+    pid_t *pids;
+    int npids;
+    int pidCap;
+    int running;
+    pid_t lastPid;
+    int status;
+    Usage usage;
+    char *cmdline;
+    bool pooled;
+    int owner;
+    char *cgroup;
+    int nextFree;
+} Job;
+
+typedef struct {
+    pid_t pid;
+    int job;
+} PidSlot;
+
+typedef struct {
+    Job *jobs;
+    int cap;
+    int count;
+    int freeHead;
+    PidSlot *slots;
+    int slotCap;
+    int slotUsed;
+} JobTable;
+
+/*---------------------------------------------------------------------
+ Buffered reader for command lines. Input is read with read(2) rather
+ than stdio so the main loop can poll() stdin alongside the SIGCHLD
+ signalfd without data hiding in a FILE buffer.
+
+ In batch mode (a script argument, or stdin that is not a terminal)
+ a script file named as an argument is mmap'd whole and lines are
+ parsed in place; other input is read in READ_BUFFER_SIZE blocks into
+ buf, which doubles whenever a single line fills it. interactive
+ controls the ": " prompt. seekable is set for a stdin that can be
+ seeked (a regular file), so read-ahead can be handed back to commands
+ that read the shell's stdin (syncLineReader).
+----------------------------------------------------------------------*/
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t len;
+    bool eof;
+    bool mapped;
+    bool interactive;
+    bool seekable;
+} LineReader;
+
+/*---------------------------------------------------------------------
+ Command location cache (the hash builtin). Maps a command name to the
+ absolute path found by walking $PATH, so a repeated command is exec'd
+ directly instead of having execvp retry execve in every PATH entry.
+ pathVar is the PATH the entries were found under.
+----------------------------------------------------------------------*/
+typedef struct PathEntry {
+    struct PathEntry *next;
+    char *name;
+    char *path;
+    unsigned long hits;
+} PathEntry;
+
+typedef struct {
+    PathEntry **buckets;
+    int nbuckets;
+    int count;
+    char *pathVar;
+    unsigned long hits;
+    unsigned long misses;
+} PathCache;
+
+/*---------------------------------------------------------------------
+ Shell variables ($NAME, export, unset). Each variable is a single
+ "NAME=value" string (entry), so an exported one goes into envp as
+ is. Buckets are chained and doubled like the path cache. envp is the
+ environ handed to children; syncEnviron() rebuilds it only when an
+ exported variable changed since the last launch (dirty), counting
+ rebuilds in generation. Strings replaced while environ may still
+ point at them wait in retired until that rebuild. envBytes is what
+ envp adds to an execve's argument space, measured in envGeneration.
+----------------------------------------------------------------------*/
+typedef struct Variable {
+    struct Variable *next;
+    char *entry;
+    size_t nameLen;
+    bool exported;
+} Variable;
+
+typedef struct {
+    Variable **buckets;
+    int nbuckets;
+    int count;
+    bool loaded;
+    bool dirty;
+    char **envp;
+    int envCap;
+    char **retired;
+    int nretired;
+    int retiredCap;
+    unsigned long generation;
+    size_t envBytes;
+    unsigned long envGeneration;
+} VariableTable;
+
+/*---------------------------------------------------------------------
+ Persistent command history ($HISTFILE, default ~/.smallsh_history).
+
+ The file is a page of header followed by a HISTORY_SIZE byte ring
+ and is mmap'd MAP_SHARED, so appending a line is a memcpy into the
+ page cache. head counts every byte ever reserved; a record lives at
+ ring offset pos % capacity. Shells sharing the file reserve space
+ with a compare-and-swap on head, copy their line in, and publish it
+ by storing ~pos in the record's tag last. A record that would run
+ past the end of the ring starts at offset 0 instead, leaving a
+ HISTORY_WRAP record (or fewer than 16 bytes) as padding.
+
+ Records are only overwritten when the ring wraps: one at pos is
+ live while head <= pos + capacity. Nothing is read at startup; the
+ history builtin indexes records lazily, continuing from scanPos.
+ A record still unpublished there is waited for, but only until it
+ has been so for HISTORY_STALL_NS since stallSince (its writer died
+ between reserving and publishing); the scan then skips past it.
+----------------------------------------------------------------------*/
+typedef struct {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;
+} HistoryHeader;
+
+typedef struct {
+    uint64_t tag;
+    uint64_t len;
+} HistoryRecord;
+
+typedef struct {
+    HistoryHeader *header;
+    char *ring;
+    uint64_t capacity;
+    uint64_t *index;
+    size_t first;
+    size_t count;
+    size_t indexCap;
+    uint64_t scanPos;
+    bool synced;
+    uint64_t stallPos;
+    uint64_t stallSince;
+} History;
+
+/*---------------------------------------------------------------------
+ Interactive line editor, used when stdin is a terminal. The terminal
+ is in raw mode only while a line is being edited, so commands always
+ run with the normal cooked settings. Bytes typed ahead of a finished
+ line stay in pending for the next one. historyPos is the history
+ index entry being shown by Up/Down (SIZE_MAX when not browsing), and
+ saved holds the line that was being typed before browsing began.
+----------------------------------------------------------------------*/
+typedef struct {
+    bool enabled;
+    struct termios cooked;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t cursor;
+    char pending[256];
+    size_t pendingStart;
+    size_t pendingLen;
+    size_t historyPos;
+    char *saved;
+} LineEditor;
+
+/*---------------------------------------------------------------------
+ Prefix trie of the executables in $PATH, for command completion.
+
+ Nodes live in one growable array; children of a node form a sibling
+ list sorted by character, so a walk lists names in order. ends counts
+ the PATH directories providing the name that ends at a node and words
+ counts every name in its subtree, so a name can be removed again by
+ decrementing along its path.
+
+ The trie is built on the first command completion. Afterwards each
+ completion only stats the PATH directories and rescans those whose
+ mtime changed, first removing the names recorded from that
+ directory's previous scan (names, NUL separated).
+----------------------------------------------------------------------*/
+typedef struct {
+    int child;
+    int sibling;
+    int words;
+    int ends;
+    char c;
+} TrieNode;
+
+typedef struct {
+    char *path;
+    struct timespec mtime;
+    bool scanned;
+    char *names;
+    size_t namesLen;
+    size_t namesCap;
+} PathDir;
+
+typedef struct {
+    TrieNode *nodes;
+    int count;
+    int cap;
+    PathDir *dirs;
+    int ndirs;
+    char *pathVar;
+} CommandTrie;
+
+typedef struct {
+    char *word;
+    char suffix;
+} Completion;
+
+typedef struct {
+    Completion *items;
+    int count;
+    int cap;
+} Completions;
+
+/*---------------------------------------------------------------------
+ A connection to the --serve socket.
+
+ Clients send command lines; each gets one reply line with its exit
+ code. Lines are run one at a time per client (the rest wait in in),
+ but clients run concurrently. A line is split into a command list
+ (list) as in the shell; status is the wait status of the list's last
+ command and pending is set until the line has been answered. stdio is
+ what their commands get as stdin, stdout and stderr: /dev/null until
+ the client passes its own descriptors with SCM_RIGHTS. Replies the
+ socket can't take yet wait in out. closing is set at end of input:
+ lines already received still run and are answered. gone is set when
+ the client can no longer be written to, and drops whatever it had
+ queued. Either way the slot is freed once no command is running. Free
+ slots are chained through nextFree.
+----------------------------------------------------------------------*/
+typedef struct {
+    int fd;
+    int stdio[3];
+    char *in;
+    size_t inLen;
+    size_t inCap;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    int job;
+    CommandList list;
+    int status;
+    bool pending;
+    bool closing;
+    bool gone;
+    int nextFree;
+} Client;
+
+typedef struct {
+    int epollFD;
+    int listenFD;
+    int nullFD;
+    Client *clients;
+    int cap;
+    int freeHead;
+    Command cmd;
+} Server;
+
+/*---------------------------------------------------------------------
+ Event trace, enabled with --trace=PATH or SMALLSH_TRACE=PATH.
+
+ Events are written to a ring of TRACE_EVENTS slots in a MAP_SHARED
+ mapping, so a child made by fork records its exec event in the same
+ ring. The other backends record exec in the shell: spawnStage once
+ posix_spawn returns (after the child's exec), zygoteStage when the
+ zygote reports the child it made. A writer claims a slot by bumping
+ head and publishes it by storing seq = slot + 1 last. The flusher
+ thread turns published slots into JSON lines in the trace file, tail
+ being the next slot it will read; slots overwritten before it got to
+ them are counted as dropped. TRACE() is a single test of tracer.ring
+ while tracing is off.
+----------------------------------------------------------------------*/
+typedef enum {
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_LAUNCH,
+    TRACE_EXEC,
+    TRACE_REAP
+} TraceType;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t ns;
+    int32_t type;
+    int32_t pid;
+    int64_t arg;
+} TraceEvent;
+
+typedef struct {
+    uint64_t head;
+    char pad[56];
+    TraceEvent events[TRACE_EVENTS];
+} TraceRing;
+
+typedef struct {
+    TraceRing *ring;
+    int fd;
+    uint64_t tail;
+    bool stopping;
+    pthread_t flusher;
+} Tracer;
+
+#define TRACE(type, pid, arg) do { if (tracer.ring != NULL) traceEvent(type, pid, arg); } while (0)
+
+/*---------------------------------------------------------------------
+ Launch backends for external commands. LAUNCH_SPAWN uses posix_spawnp,
+ which glibc implements with clone(CLONE_VM|CLONE_VFORK) and so avoids
+ copying the shell's page tables. LAUNCH_FORK is the original
+ fork/execvp path. LAUNCH_ZYGOTE hands each command to a small helper
+ process started with the shell (see runZygote), so launch cost does
+ not grow with the shell's address space. Selected with
+ --launch=spawn|fork|zygote.
+
+ pipe_size is the F_SETPIPE_SZ capacity for pipeline pipes, 0 keeps the
+ kernel default. Selected with --pipe-size=BYTES. serve_path is the
+ socket given with --serve, NULL for a normal shell. trace_path is the
+ --trace file (default $SMALLSH_TRACE), NULL when not tracing. auto_pin
+ is set by --autopin: background jobs without a "pin" prefix are pinned
+ to the shell's CPUs in turn, auto_pin_next being the next one.
+ external_builtins is set by --external-builtins: echo, true, false,
+ pwd, test, [ and printf then run as programs instead of in the shell.
+ exit_timeout is how long exit lets background jobs end after SIGTERM
+ before it kills them, in seconds (--exit-timeout=SECONDS).
+----------------------------------------------------------------------*/
+typedef enum {
+    LAUNCH_SPAWN,
+    LAUNCH_FORK,
+    LAUNCH_ZYGOTE
+} LaunchBackend;
+
+/*---------------------------------------------------------------------
+ A launch request sent to the zygote. The header is followed by the
+ exec path ("" to search PATH) and argc argument strings, each
+ NUL-terminated. The shell's working directory and whichever of
+ stdin/stdout/stderr are replaced travel as SCM_RIGHTS descriptors,
+ the directory first; bit i of fdMask is set when stdio descriptor i
+ is included. The reply is the child's pid, or -errno.
+----------------------------------------------------------------------*/
+typedef struct {
+    int argc;
+    int fdMask;
+    bool background;
+} ZygoteRequest;
+
+int foreground_only_mode = 0;
+LaunchBackend launch_backend = LAUNCH_SPAWN;
+int pipe_size = 0;
+char *serve_path = NULL;
+char *trace_path = NULL;
+bool auto_pin = false;
+bool external_builtins = false;
+double exit_timeout = 5.0;
+int auto_pin_next = 0;
+int zygote_fd = -1;
+pid_t zygote_pid = -1;
+unsigned long zygote_generation = 0;
+Tracer tracer = { .fd = -1 };
+PathCache path_cache = {};
+VariableTable variables = {};
+History history = {};
+LineEditor line_editor = {};
+CommandTrie command_trie = {};
+
+// Builtins and command prefixes offered by command completion alongside $PATH.
+const char *builtin_names[] = {
+    "cd", "exit", "status", "jobs", "wait", "kill", "hash", "parallel", "history", "time", "limit", "pin", "export", "unset", NULL
+};
+
+// execve's limits for checkArgMax, read from sysconf on first use.
+size_t arg_max = 0;
+size_t arg_strlen_max = 0;
+
+// "$$" expansion text, formatted once by cachePidString().
+char pid_string[MAX_PID_LEN + 8];
+size_t pid_string_len = 0;
+
+// "$?" and "$!": last foreground exit code and last background pid (0 if none).
+int last_exit_code = 0;
+pid_t last_background_pid = 0;
+
+// Bytes that end a run of ordinary word characters in scanWord.
+const bool word_special[256] = {
+    ['\0'] = true, [' '] = true, ['\t'] = true, ['|'] = true, ['<'] = true,
+    ['>'] = true, ['&'] = true, ['\''] = true, ['"'] = true, ['\\'] = true,
+    ['$'] = true,
+};
+
+extern char **environ;
+
+
+/**********************************************************************
+    Function: traceEvent(TraceType type, pid_t pid, int64_t arg)
+
+    Records one event in the trace ring with a CLOCK_MONOTONIC
+    timestamp. Safe to call from the shell and from forked children;
+    use it through TRACE() so nothing happens while tracing is off.
+************************************************************************/
+void traceEvent(TraceType type, pid_t pid, int64_t arg){
+    struct timespec ts;
+    uint64_t slot = __atomic_fetch_add(&tracer.ring->head, 1, __ATOMIC_RELAXED);
+    TraceEvent *event = &tracer.ring->events[slot % TRACE_EVENTS];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->type = type;
+    event->pid = pid;
+    event->arg = arg;
+    __atomic_store_n(&event->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+/**********************************************************************
+    Function: formatTraceEvent(char *out, size_t size, const TraceEvent *event)
+    Formats one event as a JSON line.
+
+    Returns:
+        Length of the line.
+************************************************************************/
+int formatTraceEvent(char *out, size_t size, const TraceEvent *event){
+    static const char *backends[] = { "spawn", "fork", "zygote" };
+    int len = snprintf(out, size, "{\"ns\":%llu,", (unsigned long long)event->ns);
+
+    switch (event->type){
+        case TRACE_READ:
+            len += snprintf(out + len, size - len, "\"event\":\"read\",\"bytes\":%lld}\n", (long long)event->arg);
+            break;
+        case TRACE_PARSE:
+            len += snprintf(out + len, size - len, "\"event\":\"parse\",\"argc\":%lld}\n", (long long)event->arg);
+            break;
+        case TRACE_LAUNCH:
+            len += snprintf(out + len, size - len, "\"event\":\"launch\",\"pid\":%d,\"backend\":\"%s\"}\n",
+                            event->pid, backends[event->arg % 3]);
+            break;
+        case TRACE_EXEC:
+            len += snprintf(out + len, size - len, "\"event\":\"exec\",\"pid\":%d}\n", event->pid);
+            break;
+        default: {
+            int status = (int)event->arg;
+            len += snprintf(out + len, size - len, "\"event\":\"reap\",\"pid\":%d,\"%s\":%d}\n", event->pid,
+                            WIFSIGNALED(status) ? "signal" : "exit",
+                            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+            break;
+        }
+    }
+    return len;
+}
+
+/**********************************************************************
+    Function: flushTrace(void *unused)
+
+    The flusher thread. Every TRACE_FLUSH_US it writes the events
+    published since the last pass to the trace file, and it exits
+    once stopTrace() has asked it to and the ring is drained. A slot
+    that was claimed but never published (its writer died) is given
+    up on after 50 passes.
+************************************************************************/
+void *flushTrace(void *unused){
+    static char buffer[65536];
+    int stalls = 0;
+
+    while (1){
+        bool stopping = __atomic_load_n(&tracer.stopping, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&tracer.ring->head, __ATOMIC_ACQUIRE);
+        uint64_t dropped = 0;
+        size_t len = 0;
+
+        while (tracer.tail < head){
+            TraceEvent *slot = &tracer.ring->events[tracer.tail % TRACE_EVENTS];
+            uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            TraceEvent event = *slot;
+
+            // Case -> Not published yet: try again next pass
+            if (seq < tracer.tail + 1 && !stopping && ++stalls < 50){
+                break;
+            }
+            // Case -> Overwritten by a later lap, or abandoned: count it as dropped
+            if (seq != tracer.tail + 1 || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq){
+                dropped++;
+            } else {
+                if (len > sizeof(buffer) - 256){
+                    write(tracer.fd, buffer, len);
+                    len = 0;
+                }
+                len += formatTraceEvent(buffer + len, sizeof(buffer) - len, &event);
+            }
+            tracer.tail++;
+            stalls = 0;
+        }
+
+        if (dropped > 0){
+            len += snprintf(buffer + len, sizeof(buffer) - len, "{\"event\":\"dropped\",\"count\":%llu}\n",
+                            (unsigned long long)dropped);
+        }
+        if (len > 0){
+            write(tracer.fd, buffer, len);
+        }
+        if (stopping && tracer.tail >= head){
+            return NULL;
+        }
+        usleep(TRACE_FLUSH_US);
+    }
+}
+
+/**********************************************************************
+    Function: openTrace(const char *path)
+
+    Starts tracing to path (created or truncated): maps the ring and
+    starts the flusher thread.
+
+    Returns:
+        0, or -1 after printing an error (tracing stays off).
+************************************************************************/
+int openTrace(const char *path){
+    TraceRing *ring;
+    int err;
+
+    tracer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (tracer.fd == -1){
+        perror(path);
+        return -1;
+    }
+    ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED){
+        perror("mmap()");
+        close(tracer.fd);
+        tracer.fd = -1;
+        return -1;
+    }
+
+    tracer.ring = ring;
+    err = pthread_create(&tracer.flusher, NULL, flushTrace, NULL);
+    if (err != 0){
+        errno = err;
+        perror("pthread_create()");
+        tracer.ring = NULL;
+        munmap(ring, sizeof(TraceRing));
+        close(tracer.fd);
+        tracer.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: stopTrace()
+    Waits for the flusher to write out every event, then closes the file.
+************************************************************************/
+void stopTrace(void){
+    if (tracer.ring != NULL){
+        __atomic_store_n(&tracer.stopping, true, __ATOMIC_RELEASE);
+        pthread_join(tracer.flusher, NULL);
+        close(tracer.fd);
+        tracer.fd = -1;
+        tracer.ring = NULL;
+    }
+}
+
+
+/**********************************************************************
+    Function: arenaReserve(Command *cmd, size_t extra)
+
+    Makes room for at least extra more bytes in the command's text
+    arena. When the arena has to move, argv and the redirect paths are
+    rebased onto the new block before the old one is freed.
+
+    Args:
+        *cmd: Pointer to the Command struct that owns the arena.
+        extra: number of bytes about to be appended.
+
+    Returns:
+        None. Exits the shell if memory cannot be allocated.
+************************************************************************/
+void arenaReserve(Command *cmd, size_t extra){
+    if (cmd->textLen + extra <= cmd->textCap){
+        return;
+    }
+
+    size_t newCap = cmd->textCap ? cmd->textCap : ARENA_MIN_SIZE;
+    while (newCap < cmd->textLen + extra){
+        newCap *= 2;
+    }
+
+    char *old = cmd->text;
+    char *text = malloc(newCap);
+    if (text == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Move existing tokens and point everything at the new block.
+    if (old != NULL){
+        memcpy(text, old, cmd->textLen);
+        for (int i = 0; i < cmd->argc; i++){
+            if (cmd->argv[i] != NULL){
+                cmd->argv[i] = text + (cmd->argv[i] - old);
+            }
+        }
+        if (cmd->redir_path_in != NULL){
+            cmd->redir_path_in = text + (cmd->redir_path_in - old);
+        }
+        if (cmd->redir_path_out != NULL){
+            cmd->redir_path_out = text + (cmd->redir_path_out - old);
+        }
+        free(old);
+    }
+
+    cmd->text = text;
+    cmd->textCap = newCap;
+}
+
+/**********************************************************************
+    Function: pushArg(Command *cmd, char *arg)
+
+    Appends a pointer to the argv vector, growing it as needed. The
+    vector always keeps one spare slot for the terminating NULL. A NULL
+    arg ends the current pipeline stage.
+************************************************************************/
+void pushArg(Command *cmd, char *arg){
+    if (cmd->argc + 2 > cmd->argvCap){
+        int newCap = cmd->argvCap ? cmd->argvCap * 2 : ARGV_MIN_SIZE;
+        char **argv = realloc(cmd->argv, newCap * sizeof(char *));
+        if (argv == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        cmd->argv = argv;
+        cmd->argvCap = newCap;
+    }
+    cmd->argv[cmd->argc++] = arg;
+    cmd->argv[cmd->argc] = NULL;
+}
+
+/**********************************************************************
+    Function: beginStage(Command *cmd)
+
+    Starts a new pipeline stage at the current end of argv.
+************************************************************************/
+void beginStage(Command *cmd){
+    if (cmd->nstages == cmd->stagesCap){
+        int newCap = cmd->stagesCap ? cmd->stagesCap * 2 : 4;
+        int *stages = realloc(cmd->stages, newCap * sizeof(int));
+        pid_t *pids = realloc(cmd->pids, newCap * sizeof(pid_t));
+        if (stages == NULL || pids == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        cmd->stages = stages;
+        cmd->pids = pids;
+        cmd->stagesCap = newCap;
+    }
+    cmd->stages[cmd->nstages++] = cmd->argc;
+}
+
+/**********************************************************************
+    Function: stageArgv(Command *cmd, int stage)
+
+    Returns the NULL-terminated argument vector of one pipeline stage.
+************************************************************************/
+char **stageArgv(Command *cmd, int stage){
+    return cmd->argv + cmd->stages[stage];
+}
+
+/**********************************************************************
+    Function: resetCommand(Command *cmd)
+
+    Clears a Command for the next line while keeping its arena and
+    argv storage allocated for reuse.
+************************************************************************/
+void resetCommand(Command *cmd){
+    cmd->textLen = 0;
+    cmd->argc = 0;
+    cmd->nstages = 0;
+    if (cmd->argv != NULL){
+        cmd->argv[0] = NULL;
+    }
+    cmd->redir_path_in = NULL;
+    cmd->redir_path_out = NULL;
+    cmd->background = false;
+}
+
+/**********************************************************************
+    Function: freeCommand(Command *cmd)
+
+    Releases a Command's storage. Only needed for Commands that do not
+    live for the whole session.
+************************************************************************/
+void freeCommand(Command *cmd){
+    free(cmd->text);
+    free(cmd->argv);
+    free(cmd->stages);
+    free(cmd->pids);
+    *cmd = (Command){};
+}
+
+/**********************************************************************
+    Function: cachePidString()
+
+    Formats the shell's pid once for "$$" expansion. Called at startup.
+************************************************************************/
+void cachePidString(void){
+    pid_string_len = sprintf(pid_string, "%d", getpid());
+}
+
+/**********************************************************************
+    Function: hashName(const char *name, size_t len)
+
+    FNV-1a hash of len bytes of name.
+************************************************************************/
+unsigned int hashName(const char *name, size_t len){
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**********************************************************************
+    Function: isNameChar(char c, bool first)
+    True if c may appear in a variable name (not as the first byte if
+    it is a digit).
+************************************************************************/
+bool isNameChar(char c, bool first){
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           (!first && c >= '0' && c <= '9');
+}
+
+/**********************************************************************
+    Function: insertVariable(Variable *var)
+
+    Links var into its bucket, doubling the bucket array first when
+    the table averages more than two variables per bucket.
+************************************************************************/
+void insertVariable(Variable *var){
+    Variable **link;
+
+    if (variables.count >= variables.nbuckets * 2){
+        int newCount = variables.nbuckets ? variables.nbuckets * 2 : 64;
+        Variable **grown = calloc(newCount, sizeof(Variable *));
+        if (grown == NULL){
+            perror("calloc()");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < variables.nbuckets; i++){
+            Variable *next;
+            for (Variable *old = variables.buckets[i]; old != NULL; old = next){
+                int b = hashName(old->entry, old->nameLen) & (newCount - 1);
+                next = old->next;
+                old->next = grown[b];
+                grown[b] = old;
+            }
+        }
+        free(variables.buckets);
+        variables.buckets = grown;
+        variables.nbuckets = newCount;
+    }
+
+    link = &variables.buckets[hashName(var->entry, var->nameLen) & (variables.nbuckets - 1)];
+    var->next = *link;
+    *link = var;
+    variables.count++;
+}
+
+/**********************************************************************
+    Function: loadVariables()
+
+    Fills the variable table from the environment the shell was
+    started with, every entry exported. Done on first use; environ is
+    left as it is until a variable changes.
+************************************************************************/
+void loadVariables(void){
+    variables.loaded = true;
+    for (char **env = environ; *env != NULL; env++){
+        char *equals = strchr(*env, '=');
+        Variable *var;
+
+        if (equals == NULL){
+            continue;
+        }
+        var = malloc(sizeof(Variable));
+        var->entry = strdup(*env);
+        if (var->entry == NULL){
+            perror("strdup()");
+            exit(EXIT_FAILURE);
+        }
+        var->nameLen = equals - *env;
+        var->exported = true;
+        insertVariable(var);
+    }
+}
+
+/**********************************************************************
+    Function: findVariable(const char *name, size_t len)
+
+    Returns:
+        The variable named by len bytes of name, or NULL if unset.
+************************************************************************/
+Variable *findVariable(const char *name, size_t len){
+    if (!variables.loaded){
+        loadVariables();
+    }
+    if (variables.nbuckets == 0){
+        return NULL;
+    }
+    for (Variable *var = variables.buckets[hashName(name, len) & (variables.nbuckets - 1)]; var != NULL; var = var->next){
+        if (var->nameLen == len && memcmp(var->entry, name, len) == 0){
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************
+    Function: getVariable(const char *name)
+
+    The shell's getenv: looks name up in the variable table, exported
+    or not.
+
+    Returns:
+        The value, or NULL if unset.
+************************************************************************/
+char *getVariable(const char *name){
+    size_t len = strlen(name);
+    Variable *var = findVariable(name, len);
+
+    return var ? var->entry + len + 1 : NULL;
+}
+
+/**********************************************************************
+    Function: retireEntry(char *entry, bool exported)
+
+    Frees a replaced "NAME=value" string, or holds it until the next
+    syncEnviron() if it was exported, since environ may point at it.
+************************************************************************/
+void retireEntry(char *entry, bool exported){
+    if (!exported){
+        free(entry);
+        return;
+    }
+    if (variables.nretired == variables.retiredCap){
+        variables.retiredCap = variables.retiredCap ? variables.retiredCap * 2 : 16;
+        variables.retired = realloc(variables.retired, variables.retiredCap * sizeof(char *));
+        if (variables.retired == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    variables.retired[variables.nretired++] = entry;
+    variables.dirty = true;
+}
+
+/**********************************************************************
+    Function: setVariable(const char *name, size_t len, const char *value, bool export)
+
+    Sets the variable named by len bytes of name to value, adding it
+    if needed. export marks it exported; an exported variable stays
+    exported. Changing an exported variable marks environ stale.
+************************************************************************/
+void setVariable(const char *name, size_t len, const char *value, bool export){
+    Variable *var = findVariable(name, len);
+    size_t valueLen = strlen(value);
+    char *entry = malloc(len + valueLen + 2);
+
+    if (entry == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, valueLen + 1);
+
+    if (var == NULL){
+        var = malloc(sizeof(Variable));
+        if (var == NULL){
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        var->entry = entry;
+        var->nameLen = len;
+        var->exported = export;
+        insertVariable(var);
+    } else {
+        retireEntry(var->entry, var->exported);
+        var->entry = entry;
+        var->exported |= export;
+    }
+    if (var->exported){
+        variables.dirty = true;
+    }
+}
+
+/**********************************************************************
+    Function: unsetVariable(const char *name)
+    Removes a variable; unknown names are ignored.
+************************************************************************/
+void unsetVariable(const char *name){
+    size_t len = strlen(name);
+    Variable **link;
+
+    if (findVariable(name, len) == NULL){
+        return;
+    }
+    link = &variables.buckets[hashName(name, len) & (variables.nbuckets - 1)];
+    while ((*link)->nameLen != len || memcmp((*link)->entry, name, len) != 0){
+        link = &(*link)->next;
+    }
+
+    Variable *var = *link;
+    *link = var->next;
+    variables.count--;
+    retireEntry(var->entry, var->exported);
+    free(var);
+}
+
+/**********************************************************************
+    Function: syncEnviron()
+
+    Rebuilds environ from the exported variables if any changed since
+    the last launch, so commands that follow an unchanged table reuse
+    the same envp. Called before every launch.
+************************************************************************/
+void syncEnviron(void){
+    int n = 0;
+
+    if (!variables.dirty){
+        return;
+    }
+    if (variables.count + 1 > variables.envCap){
+        variables.envCap = (variables.count + 1) * 2;
+        variables.envp = realloc(variables.envp, variables.envCap * sizeof(char *));
+        if (variables.envp == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < variables.nbuckets; i++){
+        for (Variable *var = variables.buckets[i]; var != NULL; var = var->next){
+            if (var->exported){
+                variables.envp[n++] = var->entry;
+            }
+        }
+    }
+    variables.envp[n] = NULL;
+    environ = variables.envp;
+
+    for (int i = 0; i < variables.nretired; i++){
+        free(variables.retired[i]);
+    }
+    variables.nretired = 0;
+    variables.dirty = false;
+    variables.generation++;
+}
+
+/**********************************************************************
+    Function: nameLength(const char *word)
+    Length of the variable name at the start of word, 0 if none.
+************************************************************************/
+size_t nameLength(const char *word){
+    size_t len = 0;
+
+    while (isNameChar(word[len], len == 0)){
+        len++;
+    }
+    return len;
+}
+
+/**********************************************************************
+    Function: expandReference(const char *p, const char **value, size_t *len)
+
+    Resolves the "$" reference starting at p ("$$" is handled by
+    scanWord itself):
+        $?        exit code of the last foreground command
+        $!        pid of the last background command, empty if none
+        $NAME     value of variable NAME, empty if unset
+        ${NAME}   the same, for use next to name characters
+
+    Returns:
+        Pointer to the first byte after the reference, or NULL if the
+        "$" does not start one and is taken literally.
+************************************************************************/
+const char *expandReference(const char *p, const char **value, size_t *len){
+    static char number[24];
+    const char *name = p + 1;
+    const char *after;
+    size_t nameLen;
+    Variable *var;
+
+    switch (p[1]){
+        case '?':
+            *len = snprintf(number, sizeof(number), "%d", last_exit_code);
+            *value = number;
+            return p + 2;
+        case '!':
+            *len = last_background_pid ? snprintf(number, sizeof(number), "%d", (int)last_background_pid) : 0;
+            *value = number;
+            return p + 2;
+        case '{':
+            name = p + 2;
+            break;
+    }
+
+    nameLen = nameLength(name);
+    if (nameLen == 0){
+        return NULL;
+    }
+    after = name + nameLen;
+    if (p[1] == '{'){
+        if (*after != '}'){
+            return NULL;
+        }
+        after++;
+    }
+
+    var = findVariable(name, nameLen);
+    *value = var ? var->entry + nameLen + 1 : "";
+    *len = var ? strlen(*value) : 0;
+    return after;
+}
+
+/**********************************************************************
+    Function: isAssignment(const char *word)
+    True if word has the form NAME=value.
+************************************************************************/
+bool isAssignment(const char *word){
+    size_t len = nameLength(word);
+
+    return len > 0 && word[len] == '=';
+}
+
+/**********************************************************************
+    Function: scanWord(const char *p, const char *end, Command *cmd)
+
+    Copies one word starting at p into the arena, handling quoting and
+    "$" expansion (see expandReference) on the way:
+        'text'    literal, no expansion
+        "text"    "$" references expanded; \\ \" \$ escaped
+        \c        c taken literally (spaces, operators, quotes, $)
+    Unquoted, the word ends at a blank or one of | < > &.
+
+    The caller has reserved end - p + 1 bytes, enough for every input
+    byte to be copied once; an expansion reserves its own extra room.
+
+    Returns:
+        Pointer to the first byte after the word, or NULL if a quote
+        was left open.
+************************************************************************/
+const char *scanWord(const char *p, const char *end, Command *cmd){
+    char *out = cmd->text + cmd->textLen;
+    char quote = 0;
+
+    while (*p != '\0'){
+
+        // Case -> Run of ordinary characters
+        if (!word_special[(unsigned char)*p] && quote == 0){
+            while (!word_special[(unsigned char)*p]){
+                *out++ = *p++;
+            }
+            continue;
+        }
+
+        char c = *p;
+
+        // Case -> Inside single quotes everything is literal
+        if (quote == '\''){
+            if (c == '\''){
+                quote = 0;
+            } else {
+                *out++ = c;
+            }
+            p++;
+            continue;
+        }
+
+        // Case -> Backslash escape (inside "" only \\ \" \$ are escapes)
+        if (c == '\\' && p[1] != '\0'){
+            if (quote == '"' && p[1] != '"' && p[1] != '\\' && p[1] != '$'){
+                *out++ = '\\';
+            }
+            *out++ = p[1];
+            p += 2;
+            continue;
+        }
+
+        // Case -> "$$": insert the cached pid string
+        if (c == '$' && p[1] == '$'){
+            p += 2;
+            cmd->textLen = out - cmd->text;
+            arenaReserve(cmd, pid_string_len + (end - p) + 1);
+            out = cmd->text + cmd->textLen;
+            for (size_t i = 0; i < pid_string_len; i++){
+                *out++ = pid_string[i];
+            }
+            continue;
+        }
+
+        // Case -> Other "$" references: insert the value ("$" alone stays literal)
+        if (c == '$'){
+            const char *value;
+            size_t valueLen;
+            const char *next = expandReference(p, &value, &valueLen);
+
+            if (next != NULL){
+                p = next;
+                cmd->textLen = out - cmd->text;
+                arenaReserve(cmd, valueLen + (end - p) + 1);
+                out = cmd->text + cmd->textLen;
+                memcpy(out, value, valueLen);
+                out += valueLen;
+                continue;
+            }
+        }
+
+        if (quote == '"'){
+            if (c == '"'){
+                quote = 0;
+            } else {
+                *out++ = c;
+            }
+            p++;
+            continue;
+        }
+
+        // Case -> Unquoted blank or operator ends the word
+        if (c == ' ' || c == '\t' || c == '|' || c == '<' || c == '>' || c == '&'){
+            break;
+        }
+
+        if (c == '\'' || c == '"'){
+            quote = c;
+        } else {
+            *out++ = c;
+        }
+        p++;
+    }
+
+    cmd->textLen = out - cmd->text;
+    return quote == 0 ? p : NULL;
+}
+
+/**********************************************************************
+    Function: scanCommand(userInput string, Command *cmd):
+
+    Parses the user's command line input into a commend struct in a
+    single pass. Words are separated by spaces or tabs and written
+    straight into the command's arena. Handles variable expansion:
+    "$$" becomes the current PID, "$?" the last exit code, "$!" the
+    last background PID and "$NAME" or "${NAME}" a variable's value.
+
+    Example: (Assume PID = 917, HOME = /home/u)
+        smallsh$$ => smallsh917
+        $$${HOME}x$$e => 917/home/ux917e
+
+    The operators | < > & are recognised wherever they appear unquoted,
+    so "ls>out" works. Quotes and backslashes make them literal; see
+    scanWord. A "|" ends the current pipeline stage and starts the
+    next. The input line is not modified.
+    
+    Args:
+        userInput: input that has been prescreened for comment/null inputs.
+        *cmd: Pointer to the Command struct that is being populated. It
+              should have been cleared with resetCommand().
+    
+    Returns:
+        0 on success, -1 after printing a message if the line is
+        malformed (unclosed quote, missing redirect file, empty
+        pipeline stage, misplaced redirect).
+
+************************************************************************/ 
+int scanCommand(const char *input, Command *cmd){
+    const char *p = input;
+    const char *end = input + strlen(input);
+    char redirect = 0;
+
+    beginStage(cmd);
+
+    while (1){
+        while (*p == ' ' || *p == '\t'){
+            p++;
+        }
+        if (*p == '\0'){
+            break;
+        }
+
+        // A redirect operator must be followed by its file name.
+        if (redirect != 0 && (*p == '|' || *p == '<' || *p == '>' || *p == '&')){
+            fprintf(stderr, "smallsh: syntax error near '%c'\n", *p);
+            return -1;
+        }
+
+        switch(*p){
+
+            // Case "|" -> End this stage, next words start a new one
+            case '|':
+                if (cmd->redir_path_out != NULL){
+                    fprintf(stderr, "smallsh: output redirect must be on the last command of a pipeline\n");
+                    return -1;
+                }
+                if (cmd->argc == cmd->stages[cmd->nstages - 1]){
+                    fprintf(stderr, "smallsh: syntax error near '|'\n");
+                    return -1;
+                }
+                pushArg(cmd, NULL);
+                beginStage(cmd);
+                p++;
+                continue;
+
+            // Case "<" -> Next word is input redirect filepath
+            case '<':
+                if (cmd->nstages > 1){
+                    fprintf(stderr, "smallsh: input redirect must be on the first command of a pipeline\n");
+                    return -1;
+                }
+                redirect = '<';
+                p++;
+                continue;
+
+            // Case ">" -> Next word is output redirect filepath
+            case '>':
+                redirect = '>';
+                p++;
+                continue;
+
+            // Case "&" -> Process will run in background
+            case '&':
+                cmd->background = true;
+                p++;
+                continue;
+        }
+
+        // Case word -> Copy to the arena, expanding "$$" as it goes.
+        arenaReserve(cmd, (end - p) + 1);
+        size_t start = cmd->textLen;
+        p = scanWord(p, end, cmd);
+        if (p == NULL){
+            fprintf(stderr, "smallsh: unterminated quote\n");
+            return -1;
+        }
+        cmd->text[cmd->textLen++] = '\0';
+
+        if (redirect == '<'){
+            cmd->redir_path_in = cmd->text + start;
+        } else if (redirect == '>'){
+            cmd->redir_path_out = cmd->text + start;
+        } else {
+            pushArg(cmd, cmd->text + start);
+        }
+        redirect = 0;
+    }
+
+    if (redirect != 0){
+        fprintf(stderr, "smallsh: missing file name after '%c'\n", redirect);
+        return -1;
+    }
+
+    // A trailing "|" leaves the last stage empty.
+    if (cmd->nstages > 1 && cmd->argc == cmd->stages[cmd->nstages - 1]){
+        fprintf(stderr, "smallsh: syntax error near '|'\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: parseCommand(const char *input, Command *cmd)
+
+    scanCommand plus a parse event in the trace (argc, or -1 if the
+    line was malformed).
+************************************************************************/
+int parseCommand(const char *input, Command *cmd){
+    int result = scanCommand(input, cmd);
+
+    TRACE(TRACE_PARSE, 0, result == -1 ? -1 : cmd->argc);
+    return result;
+}
+
+/**********************************************************************
+    Function: printCWD
+    Helper function to display the CWD for debugging
+************************************************************************/
+void printCWD(void){
+    char *buf=getcwd(NULL,0);
+    printf("CWD: %s\n", buf);
+    free(buf);
+}
+
+/**********************************************************************
+    Function: startUsage(Usage *usage)
+
+    Clears usage and stamps its start time.
+************************************************************************/
+void startUsage(Usage *usage){
+    memset(usage, 0, sizeof(Usage));
+    clock_gettime(CLOCK_MONOTONIC, &usage->started);
+}
+
+/**********************************************************************
+    Function: addUsage(Usage *usage, struct rusage *child)
+
+    Folds one reaped process's rusage into usage and stamps the finish
+    time.
+************************************************************************/
+void addUsage(Usage *usage, struct rusage *child){
+    struct rusage *total = &usage->usage;
+
+    timeradd(&total->ru_utime, &child->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &child->ru_stime, &total->ru_stime);
+    if (child->ru_maxrss > total->ru_maxrss){
+        total->ru_maxrss = child->ru_maxrss;
+    }
+    total->ru_minflt += child->ru_minflt;
+    total->ru_majflt += child->ru_majflt;
+    clock_gettime(CLOCK_MONOTONIC, &usage->finished);
+}
+
+/**********************************************************************
+    Function: elapsedSeconds(struct timespec *from, struct timespec *to)
+************************************************************************/
+double elapsedSeconds(struct timespec *from, struct timespec *to){
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**********************************************************************
+    Function: printUsage(FILE *out, Usage *usage)
+
+    Prints wall time, user/sys CPU, max RSS and page faults on one
+    line, e.g.
+        wall 1.002s  user 0.000s  sys 0.001s  maxrss 1792 KB  faults 0 major, 85 minor
+************************************************************************/
+void printUsage(FILE *out, Usage *usage){
+    struct rusage *ru = &usage->usage;
+
+    fprintf(out, "  wall %.3fs  user %ld.%03lds  sys %ld.%03lds  maxrss %ld KB  faults %ld major, %ld minor\n",
+            elapsedSeconds(&usage->started, &usage->finished),
+            (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+            (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000,
+            ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt);
+}
+
+/**********************************************************************
+    Function: formatCommand(Command *cmd)
+
+    Rebuilds a printable command line from a parsed command, e.g.
+    "sort < in | uniq -c > out &". Used to label background jobs.
+
+    Returns:
+        malloc'd string owned by the caller.
+************************************************************************/
+char *formatCommand(Command *cmd){
+    size_t size = 16;
+    char *line, *pos;
+    bool firstStage = true;
+
+    for (int i = 0; i < cmd->argc; i++){
+        size += (cmd->argv[i] ? strlen(cmd->argv[i]) : 2) + 1;
+    }
+    size += cmd->redir_path_in ? strlen(cmd->redir_path_in) + 3 : 0;
+    size += cmd->redir_path_out ? strlen(cmd->redir_path_out) + 3 : 0;
+
+    line = malloc(size);
+    if (line == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    pos = line;
+    for (int i = 0; i <= cmd->argc; i++){
+        char *word = i < cmd->argc ? cmd->argv[i] : NULL;
+
+        // Case -> End of the first stage: the input redirect goes here
+        if (word == NULL && firstStage){
+            if (cmd->redir_path_in != NULL){
+                pos += sprintf(pos, " < %s", cmd->redir_path_in);
+            }
+            firstStage = false;
+        }
+        if (i == cmd->argc){
+            break;
+        }
+        pos += sprintf(pos, "%s%s", i > 0 ? " " : "", word ? word : "|");
+    }
+    if (cmd->redir_path_out != NULL){
+        pos += sprintf(pos, " > %s", cmd->redir_path_out);
+    }
+    if (cmd->background){
+        strcpy(pos, " &");
+    }
+    return line;
+}
+
+/**********************************************************************
+ * pidHome(jobs, pid)
+ * Home slot of a pid in the pid hash.
+**********************************************************************/
+int pidHome(JobTable *jobs, pid_t pid){
+    return ((unsigned int)pid * 2654435761u) & (jobs->slotCap - 1);
+}
+
+/**********************************************************************
+ * pidFind(jobs, pid)
+ * Returns the hash slot holding pid, or -1 if it is not tracked.
+**********************************************************************/
+int pidFind(JobTable *jobs, pid_t pid){
+    if (jobs->slotCap == 0){
+        return -1;
+    }
+    for (int i = pidHome(jobs, pid); jobs->slots[i].pid != 0; i = (i + 1) & (jobs->slotCap - 1)){
+        if (jobs->slots[i].pid == pid){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**********************************************************************
+ * insertPID(jobs, pid, job)
+ * Maps a child pid to the index of its job. The hash doubles when it
+ * becomes half full.
+**********************************************************************/
+void insertPID(JobTable *jobs, pid_t pid, int job){
+    if ((jobs->slotUsed + 1) * 2 > jobs->slotCap){
+        PidSlot *old = jobs->slots;
+        int oldCap = jobs->slotCap;
+
+        jobs->slotCap = oldCap ? oldCap * 2 : 64;
+        jobs->slots = calloc(jobs->slotCap, sizeof(PidSlot));
+        if (jobs->slots == NULL){
+            perror("calloc()");
+            exit(EXIT_FAILURE);
+        }
+        jobs->slotUsed = 0;
+        for (int i = 0; i < oldCap; i++){
+            if (old[i].pid != 0){
+                insertPID(jobs, old[i].pid, old[i].job);
+            }
+        }
+        free(old);
+    }
+
+    int i = pidHome(jobs, pid);
+    while (jobs->slots[i].pid != 0){
+        i = (i + 1) & (jobs->slotCap - 1);
+    }
+    jobs->slots[i].pid = pid;
+    jobs->slots[i].job = job;
+    jobs->slotUsed++;
+}
+
+/**********************************************************************
+  removePID(jobs, pid)
+  Remove a given pid from the pid hash. Does nothing if pid is
+  not tracked. Entries after it in the probe run are shifted back so
+  no tombstones are needed.
+ 
+  Args:
+    *jobs - pointer to the job table.
+    pid - (int) process id.
+
+  Returns:
+    none
+**********************************************************************/
+void removePID(JobTable *jobs, pid_t pid){
+    int mask = jobs->slotCap - 1;
+    int i = pidFind(jobs, pid);
+    int j = i;
+
+    if (i == -1){
+        return;
+    }
+
+    while (1){
+        j = (j + 1) & mask;
+        if (jobs->slots[j].pid == 0){
+            break;
+        }
+
+        // Leave the entry alone if its home lies cyclically in (i, j].
+        int k = pidHome(jobs, jobs->slots[j].pid);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)){
+            continue;
+        }
+        jobs->slots[i] = jobs->slots[j];
+        i = j;
+    }
+    jobs->slots[i].pid = 0;
+    jobs->slotUsed--;
+}
+
+/**********************************************************************
+    Function: addJob(JobTable *jobs, Command *cmd)
+
+    Records a launched background pipeline as one job. Takes a slot
+    from the free list (growing the table when it is empty) and maps
+    every stage pid to it.
+
+    Returns:
+        The new job, or NULL if no stage was started.
+************************************************************************/
+Job *addJob(JobTable *jobs, Command *cmd){
+    Job *job;
+    int npids = 0;
+
+    for (int i = 0; i < cmd->nstages; i++){
+        npids += cmd->pids[i] != -1;
+    }
+    if (npids == 0){
+        if (cmd->limits.cgroup[0] != '\0'){
+            rmdir(cmd->limits.cgroup);
+        }
+        return NULL;
+    }
+
+    // Case -> No free slot: double the table and chain the new slots.
+    if (jobs->freeHead == -1){
+        int newCap = jobs->cap ? jobs->cap * 2 : 16;
+        Job *grown = realloc(jobs->jobs, newCap * sizeof(Job));
+        if (grown == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + jobs->cap, 0, (newCap - jobs->cap) * sizeof(Job));
+        for (int i = newCap - 1; i >= jobs->cap; i--){
+            grown[i].nextFree = jobs->freeHead;
+            jobs->freeHead = i;
+        }
+        jobs->jobs = grown;
+        jobs->cap = newCap;
+    }
+
+    int slot = jobs->freeHead;
+    job = &jobs->jobs[slot];
+    jobs->freeHead = job->nextFree;
+
+    // Reuse the slot's pid array when it is big enough.
+    if (job->pidCap < npids){
+        free(job->pids);
+        job->pids = malloc(npids * sizeof(pid_t));
+        if (job->pids == NULL){
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        job->pidCap = npids;
+    }
+
+    job->id = slot + 1;
+    job->state = JOB_RUNNING;
+    job->npids = 0;
+    for (int i = 0; i < cmd->nstages; i++){
+        if (cmd->pids[i] != -1){
+            job->pids[job->npids++] = cmd->pids[i];
+            insertPID(jobs, cmd->pids[i], slot);
+        }
+    }
+    job->running = job->npids;
+    job->lastPid = cmd->pids[cmd->nstages - 1];
+    job->status = W_EXITCODE(EXIT_FAILURE, 0);
+    startUsage(&job->usage);
+    job->cmdline = formatCommand(cmd);
+    job->pooled = false;
+    job->owner = -1;
+    job->cgroup = cmd->limits.cgroup[0] != '\0' ? strdup(cmd->limits.cgroup) : NULL;
+    jobs->count++;
+    return job;
+}
+
+/**********************************************************************
+    Function: removeJob(JobTable *jobs, Job *job)
+
+    Returns a finished job's slot to the free list.
+************************************************************************/
+void removeJob(JobTable *jobs, Job *job){
+    for (int i = 0; i < job->npids; i++){
+        removePID(jobs, job->pids[i]);
+    }
+    free(job->cmdline);
+    job->cmdline = NULL;
+    if (job->cgroup != NULL){
+        rmdir(job->cgroup);
+        free(job->cgroup);
+        job->cgroup = NULL;
+    }
+    job->state = JOB_FREE;
+    job->nextFree = jobs->freeHead;
+    jobs->freeHead = job->id - 1;
+    jobs->count--;
+}
+
+/**********************************************************************
+    Function: findJob(JobTable *jobs, char *spec)
+
+    Looks up a job by "%n" job number or by the pid of any of its
+    processes.
+
+    Returns:
+        The job, or NULL if spec does not name a live job.
+************************************************************************/
+Job *findJob(JobTable *jobs, char *spec){
+    char *end;
+    long n;
+
+    if (spec[0] == '%'){
+        n = strtol(spec + 1, &end, 10);
+        if (*end != '\0' || n < 1 || n > jobs->cap || jobs->jobs[n - 1].state == JOB_FREE){
+            return NULL;
+        }
+        return &jobs->jobs[n - 1];
+    }
+
+    n = strtol(spec, &end, 10);
+    int slot = (*end == '\0' && n > 0) ? pidFind(jobs, n) : -1;
+    return slot == -1 ? NULL : &jobs->jobs[jobs->slots[slot].job];
+}
+
+/**********************************************************************
+    Function: childChanged(JobTable *jobs, pid, wstatus, *usage)
+
+    Applies one wait4 result to the job owning pid. The job's status
+    is taken from its last stage, and the child's rusage is added to
+    the job's.
+
+    Returns:
+        The job if this was its last running process, else NULL.
+************************************************************************/
+Job *childChanged(JobTable *jobs, pid_t pid, int wstatus, struct rusage *usage){
+    int slot = pidFind(jobs, pid);
+    Job *job;
+
+    if (slot == -1){
+        return NULL;
+    }
+    job = &jobs->jobs[jobs->slots[slot].job];
+
+    if (WIFSTOPPED(wstatus)){
+        job->state = JOB_STOPPED;
+        return NULL;
+    }
+    if (WIFCONTINUED(wstatus)){
+        job->state = JOB_RUNNING;
+        return NULL;
+    }
+
+    TRACE(TRACE_REAP, pid, wstatus);
+    removePID(jobs, pid);
+    addUsage(&job->usage, usage);
+    if (pid == job->lastPid){
+        job->status = wstatus;
+    }
+    if (--job->running > 0){
+        return NULL;
+    }
+    job->state = JOB_DONE;
+    return job;
+}
+
+/**********************************************************************
+    Function: announceJob(Job *job)
+
+    Prints how a finished background job exited and what it used.
+************************************************************************/
+void announceJob(Job *job){
+    if(WIFEXITED(job->status)){
+        printf("Background process, pid %d, exited with status %d\n", job->lastPid, WEXITSTATUS(job->status));
+    } else if (WIFSIGNALED(job->status)){
+        printf("The background process, pid %d, was terminated by signal: %d\n", job->lastPid, WTERMSIG(job->status));
+    }
+    printUsage(stdout, &job->usage);
+}
+
+/**********************************************************************
+  reapBackground(*jobs)
+  Reaps every child that has changed state and announces each job
+  that has finished, then frees its slot. Called when the SIGCHLD
+  signalfd is readable, so the cost is one waitpid per completed
+  child rather than a pass over every job.
+
+  Args:
+    *jobs - pointer to the job table.
+
+  Returns:
+    Number of jobs that finished.
+**********************************************************************/
+int reapBackground(JobTable *jobs){
+    struct rusage usage;
+    int wstatus;
+    int reaped = 0;
+    pid_t childPid;
+    Job *job;
+
+    while ((childPid = wait4(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0){
+        job = childChanged(jobs, childPid, wstatus, &usage);
+        if (job != NULL){
+            announceJob(job);
+            removeJob(jobs, job);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+/**********************************************************************
+    Function: printJobs(JobTable *jobs)
+
+    The jobs builtin. Lists every background job with its number,
+    state, running time, last pid and command line.
+************************************************************************/
+void printJobs(JobTable *jobs){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < jobs->cap; i++){
+        Job *job = &jobs->jobs[i];
+        if (job->state == JOB_FREE){
+            continue;
+        }
+        printf("[%d] %-8s %6.0fs  pid %d  %s\n", job->id,
+                job->state == JOB_STOPPED ? "Stopped" : "Running",
+                elapsedSeconds(&job->usage.started, &now), job->lastPid, job->cmdline);
+    }
+}
+
+/**********************************************************************
+    Function: jobsStopped(jobs, target)
+
+    Tells whether the jobs waitJobs is waiting for are all stopped, so
+    none of them can finish until something continues it.
+
+    Args:
+        target: as for waitJobs.
+************************************************************************/
+bool jobsStopped(JobTable *jobs, int target){
+    if (target > 0){
+        return jobs->jobs[target - 1].state == JOB_STOPPED;
+    }
+    for (int i = 0; i < jobs->cap; i++){
+        if (jobs->jobs[i].state == JOB_RUNNING){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**********************************************************************
+    Function: waitJobs(jobs, target, *lastPID, *lastStatus, *lastUsage)
+
+    Blocks until background work finishes. Other jobs that finish in
+    the meantime are announced and freed as usual. A stopped job
+    would never finish, so once every job it is waiting for is stopped
+    (before or during the wait) and no other change is pending, the
+    wait gives up.
+
+    Args:
+        target: job number to wait for, 0 for the next job to finish
+                (wait -n), or -1 for every job (plain wait).
+        *lastPID, *lastStatus, *lastUsage: set to the waited job's last
+                pid, status and resource usage, so the status builtin
+                shows it. A plain wait records the last job to finish.
+
+    Returns:
+        0 when the wait is satisfied, -1 if there is nothing to wait for,
+        -2 if what is left to wait for is stopped.
+************************************************************************/
+int waitJobs(JobTable *jobs, int target, int *lastPID, int *lastStatus, Usage *lastUsage){
+    struct rusage usage;
+    int wstatus;
+    pid_t childPid;
+    Job *job;
+
+    while (jobs->count > 0){
+        int flags = WUNTRACED | WCONTINUED;
+
+        // Case -> Only stopped jobs: take changes already pending (a
+        // "kill -CONT" not yet seen), but don't block.
+        if (jobsStopped(jobs, target)){
+            flags |= WNOHANG;
+        }
+        childPid = wait4(-1, &wstatus, flags, &usage);
+        if (childPid == 0){
+            return -2;
+        }
+        if (childPid == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+
+        job = childChanged(jobs, childPid, wstatus, &usage);
+        if (job == NULL){
+            continue;
+        }
+
+        bool hit = target <= 0 || job->id == target;
+        announceJob(job);
+        if (hit){
+            *lastPID = job->lastPid;
+            *lastStatus = job->status;
+            *lastUsage = job->usage;
+        }
+        removeJob(jobs, job);
+        if (hit && target != -1){
+            return 0;
+        }
+    }
+    return target == -1 ? 0 : -1;
+}
+
+/**********************************************************************
+    Function: waitBuiltin(cmd, jobs, *lastPID, *lastStatus, *lastUsage)
+
+    The wait builtin.
+        wait            wait for every background job
+        wait -n         wait for the next background job to finish
+        wait %n|pid     wait for one job
+************************************************************************/
+void waitBuiltin(Command *cmd, JobTable *jobs, int *lastPID, int *lastStatus, Usage *lastUsage){
+    if (cmd->argv[1] == NULL){
+        if (waitJobs(jobs, -1, lastPID, lastStatus, lastUsage) == -2){
+            fprintf(stderr, "wait: remaining jobs are stopped\n");
+        }
+        return;
+    }
+
+    if (strcmp(cmd->argv[1], "-n") == 0){
+        int waited = waitJobs(jobs, 0, lastPID, lastStatus, lastUsage);
+
+        if (waited == -1){
+            fprintf(stderr, "wait: no background jobs\n");
+        } else if (waited == -2){
+            fprintf(stderr, "wait: remaining jobs are stopped\n");
+        }
+        return;
+    }
+
+    for (int i = 1; cmd->argv[i] != NULL; i++){
+        Job *job = findJob(jobs, cmd->argv[i]);
+        if (job == NULL){
+            fprintf(stderr, "wait: %s: no such job\n", cmd->argv[i]);
+            continue;
+        }
+        if (waitJobs(jobs, job->id, lastPID, lastStatus, lastUsage) == -2){
+            fprintf(stderr, "wait: %s: job stopped\n", cmd->argv[i]);
+        }
+    }
+}
+
+/**********************************************************************
+    Function: parseSignal(char *name)
+
+    Converts "9", "KILL" or "SIGKILL" to a signal number.
+
+    Returns:
+        The signal number, or -1 if name is not a signal.
+************************************************************************/
+int parseSignal(char *name){
+    char *end;
+    long n = strtol(name, &end, 10);
+
+    if (*end == '\0' && end != name){
+        return (n > 0 && n < NSIG) ? n : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0){
+        name += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++){
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcmp(abbrev, name) == 0){
+            return sig;
+        }
+    }
+    return -1;
+}
+
+/**********************************************************************
+    Function: killBuiltin(Command *cmd, JobTable *jobs)
+
+    The kill builtin: kill [-SIGNAL | -s SIGNAL] %n|pid ...
+    A job number signals every process of that job. The default
+    signal is SIGTERM.
+************************************************************************/
+void killBuiltin(Command *cmd, JobTable *jobs){
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (cmd->argv[i] != NULL && strcmp(cmd->argv[i], "-s") == 0 && cmd->argv[i + 1] != NULL){
+        sig = parseSignal(cmd->argv[i + 1]);
+        i += 2;
+    } else if (cmd->argv[i] != NULL && cmd->argv[i][0] == '-'){
+        sig = parseSignal(cmd->argv[i] + 1);
+        i++;
+    }
+
+    if (sig == -1){
+        fprintf(stderr, "kill: invalid signal\n");
+        return;
+    }
+    if (cmd->argv[i] == NULL){
+        fprintf(stderr, "usage: kill [-SIGNAL | -s SIGNAL] %%n|pid ...\n");
+        return;
+    }
+
+    for (; cmd->argv[i] != NULL; i++){
+
+        // Case -> Plain pid, which need not belong to a job
+        if (cmd->argv[i][0] != '%'){
+            char *end;
+            long pid = strtol(cmd->argv[i], &end, 10);
+            if (*end != '\0' || end == cmd->argv[i]){
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", cmd->argv[i]);
+            } else if (kill(pid, sig) == -1){
+                fprintf(stderr, "kill: (%ld) - %s\n", pid, strerror(errno));
+            }
+            continue;
+        }
+
+        // Case -> Job spec: signal every running process of the job
+        Job *job = findJob(jobs, cmd->argv[i]);
+        if (job == NULL){
+            fprintf(stderr, "kill: %s: no such job\n", cmd->argv[i]);
+            continue;
+        }
+        for (int p = 0; p < job->npids; p++){
+            if (pidFind(jobs, job->pids[p]) != -1){
+                kill(job->pids[p], sig);
+            }
+        }
+
+        // A stopped job runs again on these, so wait must not give up on it.
+        if (job->state == JOB_STOPPED && (sig == SIGCONT || sig == SIGKILL)){
+            job->state = JOB_RUNNING;
+        }
+    }
+}
+
+/**********************************************************************
+  drainSignalFD(sigFD)
+  Empties a non-blocking signalfd.
+
+  Returns:
+    true if at least one signal was pending.
+**********************************************************************/
+bool drainSignalFD(int sigFD){
+    struct signalfd_siginfo info;
+    bool pending = false;
+
+    while (read(sigFD, &info, sizeof(info)) == sizeof(info)){
+        pending = true;
+    }
+    return pending;
+}
+
+/**********************************************************************
+    Function: exitCode(int wstatus)
+
+    Converts a wait status to a shell exit code: the exit status, or
+    128 + signal number for a child killed by a signal.
+************************************************************************/
+int exitCode(int wstatus){
+    if (WIFSIGNALED(wstatus)){
+        return 128 + WTERMSIG(wstatus);
+    }
+    return WEXITSTATUS(wstatus);
+}
+
+/**********************************************************************
+    Function: addListNode(CommandList *list, int start)
+    Appends a node starting at offset start of list->text.
+************************************************************************/
+void addListNode(CommandList *list, int start){
+    if (list->nnodes == list->nodesCap){
+        int newCap = list->nodesCap ? list->nodesCap * 2 : 16;
+        ListNode *nodes = realloc(list->nodes, newCap * sizeof(ListNode));
+        if (nodes == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        list->nodes = nodes;
+        list->nodesCap = newCap;
+    }
+    list->nodes[list->nnodes].start = start;
+    list->nodes[list->nnodes].op = LIST_END;
+    list->nnodes++;
+}
+
+/**********************************************************************
+    Function: splitList(const char *line, CommandList *list)
+
+    Splits line at every ;, && and || outside quotes into list's
+    nodes, over a copy of the line with each operator overwritten by
+    NULs. A trailing ";" is allowed; an empty command next to an
+    operator is a syntax error.
+
+    Returns:
+        0, or -1 after printing a message (list is left empty).
+************************************************************************/
+int splitList(const char *line, CommandList *list){
+    size_t len = strlen(line);
+    char quote = 0;
+    char *text;
+
+    if (len + 1 > list->textCap){
+        free(list->text);
+        list->textCap = len + 1 > 256 ? len + 1 : 256;
+        list->text = malloc(list->textCap);
+        if (list->text == NULL){
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    text = list->text;
+    memcpy(text, line, len + 1);
+    list->nnodes = 0;
+    list->next = 0;
+    addListNode(list, 0);
+
+    for (size_t i = 0; i < len; i++){
+        char c = text[i];
+        ListOp op = LIST_END;
+        int width = 1;
+
+        // Case -> Quoted or escaped bytes never separate commands
+        if (quote != 0){
+            if (c == quote){
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && text[i + 1] != '\0'){
+                i++;
+            }
+            continue;
+        }
+        if (c == '\\' && text[i + 1] != '\0'){
+            i++;
+            continue;
+        }
+        if (c == '\'' || c == '"'){
+            quote = c;
+            continue;
+        }
+
+        if (c == ';'){
+            op = LIST_SEQ;
+        } else if (c == '&' && text[i + 1] == '&'){
+            op = LIST_AND;
+            width = 2;
+        } else if (c == '|' && text[i + 1] == '|'){
+            op = LIST_OR;
+            width = 2;
+        }
+        if (op == LIST_END){
+            continue;
+        }
+
+        ListNode *node = &list->nodes[list->nnodes - 1];
+        if (node->start + strspn(text + node->start, " \t") >= i){
+            fprintf(stderr, "smallsh: syntax error near '%.*s'\n", width, line + i);
+            list->nnodes = 0;
+            return -1;
+        }
+        memset(text + i, '\0', width);
+        node->op = op;
+        addListNode(list, i + width);
+        i += width - 1;
+    }
+
+    // Case -> Nothing after the last operator: fine after ";", an error after && or ||
+    ListNode *last = &list->nodes[list->nnodes - 1];
+    if (list->nnodes > 1 && text[last->start + strspn(text + last->start, " \t")] == '\0'){
+        list->nnodes--;
+        if (list->nodes[list->nnodes - 1].op != LIST_SEQ){
+            fprintf(stderr, "smallsh: syntax error at end of line\n");
+            list->nnodes = 0;
+            return -1;
+        }
+        list->nodes[list->nnodes - 1].op = LIST_END;
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: nextListNode(CommandList *list, int wstatus)
+
+    Steps to the next node that should run, given the wait status of
+    the last command that ran: after && only if it succeeded, after
+    || only if it failed, after ; always. Skipped nodes leave the
+    status alone, so "false && a || b" runs b.
+
+    Returns:
+        The node's text, or NULL once the list is finished.
+************************************************************************/
+char *nextListNode(CommandList *list, int wstatus){
+    while (list->next < list->nnodes){
+        int i = list->next++;
+        ListOp op = i == 0 ? LIST_SEQ : list->nodes[i - 1].op;
+
+        if (op == LIST_SEQ || (op == LIST_AND) == (exitCode(wstatus) == 0)){
+            return list->text + list->nodes[i].start;
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************
+    Function: cd(Command *cmd)
+    Change the current working directory of smallsh.
+
+    Args:
+        cmd: pointer to parsed command struct.
+
+        path (CMD->argv[1]): if specified as the first arg after cd in user 
+        input, change to this directory path. If cd is called without other
+        arguments, it will change to the path specified in the HOME
+        env variable.
+
+    Returns:
+        0, or -1 after printing an error.
+    
+    Changes:
+        PWD to HOME or path found in CMD->argv[1]
+
+************************************************************************/
+int changeDir(Command *cmd){
+
+    char* path = cmd->argv[1];
+
+    // Case -> cd without path: Change to HOME
+    if(path == NULL){
+        path = getVariable("HOME");
+        if (path == NULL){
+            fprintf(stderr, "cd: HOME not set\n");
+            return -1;
+        }
+    }
+
+    // Case -> cd with path: change to path
+    if (chdir(path) == -1){
+        fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+    
+/**********************************************************************
+    Function: stopZygote()
+    Closes the zygote's socket, which ends it, and reaps it.
+************************************************************************/
+void stopZygote(void){
+    if (zygote_fd != -1){
+        close(zygote_fd);
+        zygote_fd = -1;
+        waitpid(zygote_pid, NULL, 0);
+    }
+}
+
+/**********************************************************************
+    Function: signalJobs(JobTable *jobs, int sig)
+
+    Sends sig to every process of every job that has not been reaped.
+    Stopped jobs are also continued so they can act on it.
+************************************************************************/
+void signalJobs(JobTable *jobs, int sig){
+    for (int i = 0; i < jobs->cap; i++){
+        Job *job = &jobs->jobs[i];
+        if (job->state == JOB_FREE){
+            continue;
+        }
+        for (int p = 0; p < job->npids; p++){
+            if (pidFind(jobs, job->pids[p]) != -1){
+                kill(job->pids[p], sig);
+                if (job->state == JOB_STOPPED){
+                    kill(job->pids[p], SIGCONT);
+                }
+            }
+        }
+    }
+}
+
+/**********************************************************************
+    Function: shutdownJobs(JobTable *jobs)
+
+    Ends the background jobs for exit. Every job gets SIGTERM at once,
+    then all of them are reaped together as they finish, sleeping in
+    sigtimedwait for SIGCHLD. Jobs still running after exit_timeout
+    seconds get SIGKILL. One summary line is printed, so the time taken
+    is bounded by the deadline rather than by the jobs.
+************************************************************************/
+void shutdownJobs(JobTable *jobs){
+    struct timespec started, now, left;
+    struct rusage usage;
+    sigset_t childMask;
+    int wstatus;
+    int total = jobs->count;
+    int killed = 0;
+    pid_t childPid;
+    Job *job;
+
+    if (total == 0){
+        return;
+    }
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    signalJobs(jobs, SIGTERM);
+
+    while (jobs->count > 0){
+        int flags = killed > 0 ? 0 : WNOHANG;
+
+        // Case -> Reap whatever has finished; after SIGKILL, block until all have.
+        while (jobs->count > 0 && (childPid = wait4(-1, &wstatus, flags, &usage)) > 0){
+            job = childChanged(jobs, childPid, wstatus, &usage);
+            if (job != NULL){
+                removeJob(jobs, job);
+            }
+        }
+        if (jobs->count == 0 || killed > 0){
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double remaining = exit_timeout - ((now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9);
+
+        // Case -> Deadline passed: kill the stragglers.
+        if (remaining <= 0){
+            killed = jobs->count;
+            signalJobs(jobs, SIGKILL);
+            continue;
+        }
+        left.tv_sec = (time_t)remaining;
+        left.tv_nsec = (long)((remaining - left.tv_sec) * 1e9);
+        sigtimedwait(&childMask, NULL, &left);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("Ended %d background job%s in %.2fs: %d on SIGTERM, %d killed after %gs\n",
+            total, total == 1 ? "" : "s",
+            (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9,
+            total - killed, killed, exit_timeout);
+}
+
+/**********************************************************************
+    Function: exitProgram(*jobs, code)
+
+    Exits the program, first ending any background jobs still running
+    (shutdownJobs).
+
+    Args:
+        Pointer to the background job table
+        code: exit status of the shell
+************************************************************************/ 
+int exitProgram(JobTable *jobs, int code){
+    stopZygote();
+    shutdownJobs(jobs);
+    stopTrace();
+    printf("Exiting...\n");
+    exit(code);
+}
+
+/***********************************************************************
+ Function: handle_SIGTSTP()
+ 
+ Displays message and toggles foreground_only_mode, which causes
+ the shell to toggle foreground_only_mode, which will ignore 
+ any & symbols found in subsequent user commands.
+ ************************************************************************/ 
+void handle_SIGTSTP(int signo){
+    char* message_on = "Entering foreground-only mode (& is now ignored)\n:\0";
+    char* message_off = "Foreground-only mode off (& no longer ignored)\n:\0";
+
+    // Toggle foreground_only_mode
+    foreground_only_mode = !foreground_only_mode;
+
+    // Send appropriate message
+    foreground_only_mode ? write(STDOUT_FILENO, message_on, 53): 
+                            write(STDOUT_FILENO, message_off, 51);
+    return;
+}
+
+
+/**********************************************************************
+    Function: hashString(const char *str)
+
+    FNV-1a hash of a NUL-terminated string.
+************************************************************************/
+unsigned int hashString(const char *str){
+    return hashName(str, strlen(str));
+}
+
+/**********************************************************************
+    Function: clearPathCache()
+
+    Forgets every remembered command location. Counters are kept.
+************************************************************************/
+void clearPathCache(void){
+    for (int i = 0; i < path_cache.nbuckets; i++){
+        PathEntry *entry = path_cache.buckets[i];
+        while (entry != NULL){
+            PathEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache.buckets[i] = NULL;
+    }
+    path_cache.count = 0;
+}
+
+/**********************************************************************
+    Function: forgetCommand(const char *name)
+
+    Drops one command from the location cache, e.g. after exec of its
+    cached path failed with ENOENT.
+************************************************************************/
+void forgetCommand(const char *name){
+    if (path_cache.nbuckets == 0){
+        return;
+    }
+
+    PathEntry **link = &path_cache.buckets[hashString(name) & (path_cache.nbuckets - 1)];
+    while (*link != NULL){
+        PathEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0){
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            path_cache.count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**********************************************************************
+    Function: rememberCommand(const char *name, const char *path)
+
+    Adds a name -> absolute path entry, doubling the bucket array when
+    the table gets as many entries as buckets.
+
+    Returns:
+        The new entry.
+************************************************************************/
+PathEntry *rememberCommand(const char *name, const char *path){
+    PathEntry *entry;
+
+    if (path_cache.count >= path_cache.nbuckets){
+        int newCount = path_cache.nbuckets ? path_cache.nbuckets * 2 : 64;
+        PathEntry **buckets = calloc(newCount, sizeof(PathEntry *));
+        if (buckets == NULL){
+            perror("calloc()");
+            exit(EXIT_FAILURE);
+        }
+
+        // Rehash the existing chains into the new buckets.
+        for (int i = 0; i < path_cache.nbuckets; i++){
+            entry = path_cache.buckets[i];
+            while (entry != NULL){
+                PathEntry *next = entry->next;
+                int b = hashString(entry->name) & (newCount - 1);
+                entry->next = buckets[b];
+                buckets[b] = entry;
+                entry = next;
+            }
+        }
+        free(path_cache.buckets);
+        path_cache.buckets = buckets;
+        path_cache.nbuckets = newCount;
+    }
+
+    entry = malloc(sizeof(PathEntry));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL || (entry->path = strdup(path)) == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    entry->hits = 0;
+
+    int b = hashString(name) & (path_cache.nbuckets - 1);
+    entry->next = path_cache.buckets[b];
+    path_cache.buckets[b] = entry;
+    path_cache.count++;
+    return entry;
+}
+
+/**********************************************************************
+    Function: findCommand(const char *name, bool *cached)
+
+    Resolves a command name to the executable execvp would run. Names
+    containing '/' are returned unchanged. Otherwise the location cache
+    is consulted first, and on a miss each $PATH directory is tried
+    once and the result remembered. The cache is cleared when PATH is
+    different from the value it was filled under.
+
+    Args:
+        name: argv[0] of the command.
+        *cached: set to true if the result came from the cache.
+
+    Returns:
+        Path to exec (owned by the cache or by the caller's argv), or
+        NULL if no PATH directory holds an executable of that name.
+************************************************************************/
+char *findCommand(const char *name, bool *cached){
+    const char *pathVar = getVariable("PATH");
+    char candidate[PATH_MAX];
+    struct stat info;
+
+    *cached = false;
+    if (strchr(name, '/') != NULL){
+        return (char *)name;
+    }
+
+    // Case -> PATH changed since the cache was filled
+    if (pathVar == NULL){
+        pathVar = "/bin:/usr/bin";
+    }
+    if (path_cache.pathVar == NULL || strcmp(path_cache.pathVar, pathVar) != 0){
+        clearPathCache();
+        free(path_cache.pathVar);
+        path_cache.pathVar = strdup(pathVar);
+    }
+
+    if (path_cache.nbuckets > 0){
+        for (PathEntry *entry = path_cache.buckets[hashString(name) & (path_cache.nbuckets - 1)];
+                entry != NULL; entry = entry->next){
+            if (strcmp(entry->name, name) == 0){
+                entry->hits++;
+                path_cache.hits++;
+                *cached = true;
+                return entry->path;
+            }
+        }
+    }
+    path_cache.misses++;
+
+    // Walk PATH; an empty element means the current directory.
+    const char *dir = pathVar;
+    while (1){
+        const char *end = strchrnul(dir, ':');
+        int dirLen = end - dir;
+
+        if (dirLen == 0){
+            snprintf(candidate, sizeof(candidate), "%s", name);
+        } else {
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", dirLen, dir, name);
+        }
+        if (access(candidate, X_OK) == 0 && stat(candidate, &info) == 0 && S_ISREG(info.st_mode)){
+            PathEntry *entry = rememberCommand(name, candidate);
+            entry->hits++;
+            return entry->path;
+        }
+
+        if (*end == '\0'){
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/**********************************************************************
+    Function: findLaunchCommand(const char *name)
+
+    findCommand for the fork and zygote backends, whose children exec
+    the path where the shell can't see the result. A cached path that
+    has gone away is caught here with access() instead, forgotten and
+    looked up again, as spawnStage does when posix_spawn fails with
+    ENOENT.
+
+    Returns:
+        As findCommand.
+************************************************************************/
+char *findLaunchCommand(const char *name){
+    bool cached;
+    char *path = findCommand(name, &cached);
+
+    if (cached && access(path, X_OK) == -1 && (errno == ENOENT || errno == ENOTDIR)){
+        forgetCommand(name);
+        path = findCommand(name, &cached);
+    }
+    return path;
+}
+
+/**********************************************************************
+    Function: hashBuiltin(Command *cmd)
+
+    The hash builtin.
+        hash             list remembered commands and hit/miss counters
+        hash -r          forget every remembered command
+        hash -d name...  forget the given commands
+        hash name...     look up and remember the given commands
+************************************************************************/
+void hashBuiltin(Command *cmd){
+    bool cached;
+
+    if (cmd->argv[1] == NULL){
+        printf("hits\tcommand\n");
+        for (int i = 0; i < path_cache.nbuckets; i++){
+            for (PathEntry *entry = path_cache.buckets[i]; entry != NULL; entry = entry->next){
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
+        }
+        printf("cache hits: %lu, misses: %lu\n", path_cache.hits, path_cache.misses);
+        return;
+    }
+
+    if (strcmp(cmd->argv[1], "-r") == 0){
+        clearPathCache();
+        return;
+    }
+
+    if (strcmp(cmd->argv[1], "-d") == 0){
+        for (int i = 2; cmd->argv[i] != NULL; i++){
+            forgetCommand(cmd->argv[i]);
+        }
+        return;
+    }
+
+    for (int i = 1; cmd->argv[i] != NULL; i++){
+        if (findCommand(cmd->argv[i], &cached) == NULL){
+            fprintf(stderr, "hash: %s: not found\n", cmd->argv[i]);
+        }
+    }
+}
+
+/**********************************************************************
+    Function: exportBuiltin(Command *cmd)
+
+    export                 lists exported variables
+    export NAME=value ...  sets and exports each variable
+    export NAME ...        exports existing variables
+************************************************************************/
+void exportBuiltin(Command *cmd){
+    if (cmd->argv[1] == NULL){
+        if (!variables.loaded){
+            loadVariables();
+        }
+        for (int i = 0; i < variables.nbuckets; i++){
+            for (Variable *var = variables.buckets[i]; var != NULL; var = var->next){
+                if (var->exported){
+                    printf("export %s\n", var->entry);
+                }
+            }
+        }
+        return;
+    }
+
+    for (int i = 1; cmd->argv[i] != NULL; i++){
+        char *word = cmd->argv[i];
+        size_t len = nameLength(word);
+        Variable *var;
+
+        if (len > 0 && word[len] == '='){
+            setVariable(word, len, word + len + 1, true);
+        } else if (len > 0 && word[len] == '\0'){
+            var = findVariable(word, len);
+            if (var != NULL && !var->exported){
+                var->exported = true;
+                variables.dirty = true;
+            }
+        } else {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", word);
+        }
+    }
+}
+
+/**********************************************************************
+    Function: unsetBuiltin(Command *cmd)
+    Removes each named variable.
+************************************************************************/
+void unsetBuiltin(Command *cmd){
+    for (int i = 1; cmd->argv[i] != NULL; i++){
+        unsetVariable(cmd->argv[i]);
+    }
+}
+
+/**********************************************************************
+    Function: isAssignmentLine(Command *cmd)
+    True if every word of a one-stage command is NAME=value.
+************************************************************************/
+bool isAssignmentLine(Command *cmd){
+    if (cmd->nstages != 1 || cmd->argc == 0){
+        return false;
+    }
+    for (int i = 0; cmd->argv[i] != NULL; i++){
+        if (!isAssignment(cmd->argv[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**********************************************************************
+    Function: assignVariables(Command *cmd)
+
+    Runs a line of NAME=value words: sets each as a shell variable,
+    which children see only once it is exported.
+************************************************************************/
+void assignVariables(Command *cmd){
+    for (int i = 0; cmd->argv[i] != NULL; i++){
+        size_t len = strchr(cmd->argv[i], '=') - cmd->argv[i];
+        setVariable(cmd->argv[i], len, cmd->argv[i] + len + 1, false);
+    }
+}
+
+/**********************************************************************
+    Function: openHistory()
+
+    Maps the history file, creating it if needed. Only the header is
+    touched, so this costs the same however much history there is. On
+    any error history is left disabled.
+************************************************************************/
+void openHistory(void){
+    char path[PATH_MAX];
+    char *file = getVariable("HISTFILE");
+    char *home = getVariable("HOME");
+    struct stat info;
+    HistoryHeader *header;
+    size_t size = HISTORY_DATA_OFFSET + HISTORY_SIZE;
+    int fd;
+
+    if (file == NULL){
+        if (home == NULL){
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.smallsh_history", home);
+        file = path;
+    }
+
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1){
+        perror(file);
+        return;
+    }
+
+    // Case -> New file: size it (sparse) and write the header under a lock.
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &info) == 0 && info.st_size == 0){
+        HistoryHeader fresh = { "SMLHIST", HISTORY_SIZE, 0 };
+        if (ftruncate(fd, size) == -1 || pwrite(fd, &fresh, sizeof(fresh), 0) != sizeof(fresh)){
+            perror(file);
+        }
+        info.st_size = size;
+    }
+    flock(fd, LOCK_UN);
+
+    if (info.st_size < HISTORY_DATA_OFFSET){
+        fprintf(stderr, "smallsh: %s is not a history file, history disabled\n", file);
+        close(fd);
+        return;
+    }
+    size = info.st_size;
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED){
+        perror("history mmap()");
+        return;
+    }
+    if (memcmp(header->magic, "SMLHIST", 8) != 0 || header->capacity % 8 != 0 ||
+            header->capacity + HISTORY_DATA_OFFSET > size){
+        fprintf(stderr, "smallsh: %s is not a history file, history disabled\n", file);
+        munmap(header, size);
+        return;
+    }
+
+    history.header = header;
+    history.ring = (char *)header + HISTORY_DATA_OFFSET;
+    history.capacity = header->capacity;
+}
+
+/**********************************************************************
+    Function: historyRecord(uint64_t pos)
+
+    Returns the record at logical position pos.
+************************************************************************/
+HistoryRecord *historyRecord(uint64_t pos){
+    return (HistoryRecord *)(history.ring + pos % history.capacity);
+}
+
+/**********************************************************************
+    Function: appendHistory(const char *line)
+
+    Adds a line to the history ring. Space is claimed with a CAS on the
+    shared head so concurrent shells never write the same bytes.
+************************************************************************/
+void appendHistory(const char *line){
+    uint64_t len = strlen(line);
+    uint64_t size = (sizeof(HistoryRecord) + len + 7) & ~7ULL;
+    uint64_t head, pos, room;
+    HistoryRecord *record;
+
+    if (history.header == NULL || size > history.capacity / 2){
+        return;
+    }
+
+    head = __atomic_load_n(&history.header->head, __ATOMIC_ACQUIRE);
+    do {
+        // Case -> Not enough room before the end of the ring: start at 0.
+        room = history.capacity - head % history.capacity;
+        pos = room < size ? head + room : head;
+    } while (!__atomic_compare_exchange_n(&history.header->head, &head, pos + size,
+                                          false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (pos != head && room >= sizeof(HistoryRecord)){
+        record = historyRecord(head);
+        record->len = HISTORY_WRAP;
+        __atomic_store_n(&record->tag, ~head, __ATOMIC_RELEASE);
+    }
+
+    record = historyRecord(pos);
+    record->len = len;
+    memcpy(record + 1, line, len);
+    __atomic_store_n(&record->tag, ~pos, __ATOMIC_RELEASE);
+}
+
+/**********************************************************************
+    Function: historyStalled(uint64_t pos)
+
+    True once the record at pos has been found unpublished for
+    HISTORY_STALL_NS, timed from the first time it was seen so.
+************************************************************************/
+bool historyStalled(uint64_t pos){
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (history.stallSince == 0 || history.stallPos != pos){
+        history.stallPos = pos;
+        history.stallSince = now;
+        return false;
+    }
+    return now - history.stallSince >= HISTORY_STALL_NS;
+}
+
+/**********************************************************************
+    Function: indexHistory()
+
+    Brings the history index up to date with records appended (by this
+    or any other shell) since the last call, and drops entries the
+    ring has since overwritten. The first call finds the oldest whole
+    record by looking for a tag that matches its own position; the
+    same search steps over a record whose writer never published it.
+************************************************************************/
+void indexHistory(void){
+    uint64_t head = __atomic_load_n(&history.header->head, __ATOMIC_ACQUIRE);
+    uint64_t oldest = head > history.capacity ? head - history.capacity : 0;
+    uint64_t pos = history.scanPos;
+
+    // Case -> Fell a whole ring behind: search for a record boundary again.
+    if (pos < oldest){
+        pos = oldest;
+        history.synced = false;
+    }
+
+    while (pos < head){
+        uint64_t room = history.capacity - pos % history.capacity;
+        HistoryRecord *record = historyRecord(pos);
+
+        if (room < sizeof(HistoryRecord)){
+            pos += room;
+            continue;
+        }
+
+        if (__atomic_load_n(&record->tag, __ATOMIC_ACQUIRE) != ~pos){
+            // Case -> Another shell is still writing here: resume from it next time,
+            //         unless it has stalled, then look for the next record.
+            if (history.synced && !historyStalled(pos)){
+                break;
+            }
+            history.synced = false;
+            pos += 8;
+            continue;
+        }
+        history.synced = true;
+
+        if (record->len == HISTORY_WRAP){
+            pos += room;
+            continue;
+        }
+
+        if (history.count == history.indexCap){
+            size_t newCap = history.indexCap ? history.indexCap * 2 : 1024;
+            uint64_t *index = realloc(history.index, newCap * sizeof(uint64_t));
+            if (index == NULL){
+                perror("realloc()");
+                exit(EXIT_FAILURE);
+            }
+            history.index = index;
+            history.indexCap = newCap;
+        }
+        history.index[history.count++] = pos;
+        pos += (sizeof(HistoryRecord) + record->len + 7) & ~7ULL;
+    }
+    history.scanPos = pos;
+
+    // Drop overwritten entries, compacting once they are half the index.
+    while (history.first < history.count && history.index[history.first] + history.capacity < head){
+        history.first++;
+    }
+    if (history.first > history.count / 2){
+        memmove(history.index, history.index + history.first,
+                (history.count - history.first) * sizeof(uint64_t));
+        history.count -= history.first;
+        history.first = 0;
+    }
+}
+
+/**********************************************************************
+    Function: historyBuiltin(Command *cmd)
+
+    The history builtin.
+        history             list every entry, oldest first
+        history N           list the last N entries
+        history -s TEXT     list entries containing TEXT
+
+    -s is a memmem scan over every indexed entry; there is no search
+    index, so it costs time in proportion to the saved history.
+************************************************************************/
+void historyBuiltin(Command *cmd){
+    char *pattern = NULL;
+    size_t patternLen = 0;
+    size_t from;
+
+    if (history.header == NULL){
+        openHistory();
+    }
+    if (history.header == NULL){
+        fprintf(stderr, "history: no history file\n");
+        return;
+    }
+    indexHistory();
+    from = history.first;
+
+    if (cmd->argv[1] != NULL && strcmp(cmd->argv[1], "-s") == 0){
+        pattern = cmd->argv[2];
+        if (pattern == NULL){
+            fprintf(stderr, "usage: history [N | -s text]\n");
+            return;
+        }
+        patternLen = strlen(pattern);
+    } else if (cmd->argv[1] != NULL){
+        size_t n = strtoul(cmd->argv[1], NULL, 10);
+        if (n < history.count - from){
+            from = history.count - n;
+        }
+    }
+
+    for (size_t i = from; i < history.count; i++){
+        HistoryRecord *record = historyRecord(history.index[i]);
+        char *text = (char *)(record + 1);
+
+        // Skip an entry another shell has overwritten since indexHistory.
+        if (__atomic_load_n(&record->tag, __ATOMIC_ACQUIRE) != ~history.index[i] || record->len > history.capacity){
+            continue;
+        }
+        if (pattern != NULL && memmem(text, record->len, pattern, patternLen) == NULL){
+            continue;
+        }
+        printf("%5zu  %.*s\n", i - history.first + 1, (int)record->len, text);
+    }
+}
+
+/**********************************************************************
+    Function: newTrieNode(char c)
+
+    Appends an empty node to the command trie.
+
+    Returns:
+        Index of the new node.
+************************************************************************/
+int newTrieNode(char c){
+    if (command_trie.count == command_trie.cap){
+        int newCap = command_trie.cap ? command_trie.cap * 2 : 1024;
+        TrieNode *nodes = realloc(command_trie.nodes, newCap * sizeof(TrieNode));
+        if (nodes == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        command_trie.nodes = nodes;
+        command_trie.cap = newCap;
+    }
+    command_trie.nodes[command_trie.count] = (TrieNode){ -1, -1, 0, 0, c };
+    return command_trie.count++;
+}
+
+/**********************************************************************
+    Function: trieChild(int parent, char c, bool create)
+
+    Finds the child of parent for character c, adding it in sorted
+    position when create is set.
+
+    Returns:
+        Index of the child, or -1 if it does not exist.
+************************************************************************/
+int trieChild(int parent, char c, bool create){
+    int prev = -1;
+    int node = command_trie.nodes[parent].child;
+    int added;
+
+    while (node != -1 && command_trie.nodes[node].c < c){
+        prev = node;
+        node = command_trie.nodes[node].sibling;
+    }
+    if (node != -1 && command_trie.nodes[node].c == c){
+        return node;
+    }
+    if (!create){
+        return -1;
+    }
+
+    added = newTrieNode(c);
+    command_trie.nodes[added].sibling = node;
+    if (prev == -1){
+        command_trie.nodes[parent].child = added;
+    } else {
+        command_trie.nodes[prev].sibling = added;
+    }
+    return added;
+}
+
+/**********************************************************************
+    Function: trieAdd(const char *name, int delta)
+
+    Adds (delta 1) or removes (delta -1) one reference to a name.
+************************************************************************/
+void trieAdd(const char *name, int delta){
+    int node = 0;
+
+    command_trie.nodes[0].words += delta;
+    for (const char *p = name; *p != '\0'; p++){
+        node = trieChild(node, *p, delta > 0);
+        command_trie.nodes[node].words += delta;
+    }
+    command_trie.nodes[node].ends += delta;
+}
+
+/**********************************************************************
+    Function: scanPathDir(PathDir *dir)
+
+    Replaces the names a PATH directory contributes to the trie with
+    the executables it holds now.
+************************************************************************/
+void scanPathDir(PathDir *dir){
+    struct dirent *entry;
+    DIR *stream;
+
+    for (char *name = dir->names; name < dir->names + dir->namesLen; name += strlen(name) + 1){
+        trieAdd(name, -1);
+    }
+    dir->namesLen = 0;
+
+    stream = opendir(dir->path);
+    if (stream == NULL){
+        return;
+    }
+    while ((entry = readdir(stream)) != NULL){
+        size_t len = strlen(entry->d_name) + 1;
+
+        if (entry->d_type == DT_DIR || entry->d_name[0] == '.' ||
+                faccessat(dirfd(stream), entry->d_name, X_OK, 0) != 0){
+            continue;
+        }
+
+        if (dir->namesLen + len > dir->namesCap){
+            size_t newCap = dir->namesCap ? dir->namesCap * 2 : 4096;
+            while (newCap < dir->namesLen + len){
+                newCap *= 2;
+            }
+            char *names = realloc(dir->names, newCap);
+            if (names == NULL){
+                perror("realloc()");
+                exit(EXIT_FAILURE);
+            }
+            dir->names = names;
+            dir->namesCap = newCap;
+        }
+        memcpy(dir->names + dir->namesLen, entry->d_name, len);
+        dir->namesLen += len;
+        trieAdd(entry->d_name, 1);
+    }
+    closedir(stream);
+}
+
+/**********************************************************************
+    Function: refreshCommandTrie()
+
+    Brings the command trie up to date with $PATH. A new PATH value
+    rebuilds the directory list; otherwise only directories whose
+    mtime changed since their last scan are read again.
+************************************************************************/
+void refreshCommandTrie(void){
+    char *pathVar = getVariable("PATH");
+    struct stat info;
+
+    if (pathVar == NULL){
+        pathVar = "";
+    }
+    if (command_trie.count == 0){
+        newTrieNode('\0');
+    }
+
+    // Case -> PATH changed: drop every directory and split the new value.
+    if (command_trie.pathVar == NULL || strcmp(command_trie.pathVar, pathVar) != 0){
+        for (int i = 0; i < command_trie.ndirs; i++){
+            PathDir *dir = &command_trie.dirs[i];
+            for (char *name = dir->names; name < dir->names + dir->namesLen; name += strlen(name) + 1){
+                trieAdd(name, -1);
+            }
+            free(dir->path);
+            free(dir->names);
+        }
+        free(command_trie.dirs);
+        free(command_trie.pathVar);
+        command_trie.pathVar = strdup(pathVar);
+
+        command_trie.ndirs = 1;
+        for (char *p = pathVar; *p != '\0'; p++){
+            command_trie.ndirs += *p == ':';
+        }
+        command_trie.dirs = calloc(command_trie.ndirs, sizeof(PathDir));
+        if (command_trie.pathVar == NULL || command_trie.dirs == NULL){
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+
+        char *start = pathVar;
+        for (int i = 0; i < command_trie.ndirs; i++){
+            size_t len = strcspn(start, ":");
+            command_trie.dirs[i].path = len ? strndup(start, len) : strdup(".");
+            start += len + 1;
+        }
+    }
+
+    for (int i = 0; i < command_trie.ndirs; i++){
+        PathDir *dir = &command_trie.dirs[i];
+
+        if (stat(dir->path, &info) == -1){
+            info.st_mtim = (struct timespec){};
+        }
+        if (!dir->scanned || info.st_mtim.tv_sec != dir->mtime.tv_sec || info.st_mtim.tv_nsec != dir->mtime.tv_nsec){
+            dir->mtime = info.st_mtim;
+            dir->scanned = true;
+            scanPathDir(dir);
+        }
+    }
+}
+
+/**********************************************************************
+    Function: addCompletion(list, word, len, suffix)
+
+    Adds a candidate to a completion list. suffix (' ' or '/') is
+    typed after the word when it is the only match.
+************************************************************************/
+void addCompletion(Completions *list, const char *word, size_t len, char suffix){
+    if (list->count == list->cap){
+        int newCap = list->cap ? list->cap * 2 : 64;
+        Completion *items = realloc(list->items, newCap * sizeof(Completion));
+        if (items == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        list->items = items;
+        list->cap = newCap;
+    }
+    list->items[list->count].word = strndup(word, len);
+    list->items[list->count].suffix = suffix;
+    list->count++;
+}
+
+/**********************************************************************
+    Function: collectCommands(int node, char *word, size_t depth, list)
+
+    Adds every name in the subtree of node to list. word holds the
+    depth characters leading to node.
+************************************************************************/
+void collectCommands(int node, char *word, size_t depth, Completions *list){
+    if (command_trie.nodes[node].ends > 0){
+        addCompletion(list, word, depth, ' ');
+    }
+    if (depth >= NAME_MAX){
+        return;
+    }
+    for (int child = command_trie.nodes[node].child; child != -1; child = command_trie.nodes[child].sibling){
+        if (command_trie.nodes[child].words > 0){
+            word[depth] = command_trie.nodes[child].c;
+            collectCommands(child, word, depth + 1, list);
+        }
+    }
+}
+
+/**********************************************************************
+    Function: compareCompletions(const void *a, const void *b)
+
+    qsort comparison by word.
+************************************************************************/
+int compareCompletions(const void *a, const void *b){
+    return strcmp(((Completion *)a)->word, ((Completion *)b)->word);
+}
+
+/**********************************************************************
+    Function: completeCommand(const char *prefix, Completions *list)
+
+    Lists the builtins and $PATH executables starting with prefix.
+************************************************************************/
+void completeCommand(const char *prefix, Completions *list){
+    char word[NAME_MAX + 1];
+    size_t len = strlen(prefix);
+    int node = 0;
+    int kept = 0;
+
+    refreshCommandTrie();
+    for (size_t i = 0; i < len && node != -1; i++){
+        node = trieChild(node, prefix[i], false);
+    }
+    if (node != -1 && len <= NAME_MAX && command_trie.nodes[node].words > 0){
+        memcpy(word, prefix, len);
+        collectCommands(node, word, len, list);
+    }
+
+    for (int i = 0; builtin_names[i] != NULL; i++){
+        if (strncmp(builtin_names[i], prefix, len) == 0){
+            addCompletion(list, builtin_names[i], strlen(builtin_names[i]), ' ');
+        }
+    }
+
+    // Sort the builtins in and drop names found in more than one place.
+    qsort(list->items, list->count, sizeof(Completion), compareCompletions);
+    for (int i = 0; i < list->count; i++){
+        if (kept > 0 && strcmp(list->items[kept - 1].word, list->items[i].word) == 0){
+            free(list->items[i].word);
+            continue;
+        }
+        list->items[kept++] = list->items[i];
+    }
+    list->count = kept;
+}
+
+/**********************************************************************
+    Function: completeFile(const char *prefix, Completions *list)
+
+    Lists the files whose path starts with prefix. Directories get a
+    '/' suffix; hidden files are only offered for a prefix naming one.
+************************************************************************/
+void completeFile(const char *prefix, Completions *list){
+    const char *slash = strrchr(prefix, '/');
+    const char *base = slash ? slash + 1 : prefix;
+    size_t dirLen = slash ? (size_t)(slash - prefix) + 1 : 0;
+    size_t baseLen = strlen(base);
+    char dir[PATH_MAX];
+    char word[PATH_MAX];
+    struct dirent *entry;
+    struct stat info;
+    DIR *stream;
+
+    if (dirLen + NAME_MAX + 1 > sizeof(dir)){
+        return;
+    }
+    memcpy(dir, prefix, dirLen);
+    strcpy(dir + dirLen, dirLen ? "" : ".");
+
+    stream = opendir(dir);
+    if (stream == NULL){
+        return;
+    }
+    memcpy(word, prefix, dirLen);
+    while ((entry = readdir(stream)) != NULL){
+        char *name = entry->d_name;
+        bool isDir = entry->d_type == DT_DIR;
+
+        if (strncmp(name, base, baseLen) != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                (name[0] == '.' && base[0] != '.')){
+            continue;
+        }
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN){
+            isDir = fstatat(dirfd(stream), name, &info, 0) == 0 && S_ISDIR(info.st_mode);
+        }
+        strcpy(word + dirLen, name);
+        addCompletion(list, word, strlen(word), isDir ? '/' : ' ');
+    }
+    closedir(stream);
+    qsort(list->items, list->count, sizeof(Completion), compareCompletions);
+}
+
+/**********************************************************************
+    Function: openLineEditor(LineReader *reader)
+
+    Enables the line editor if the interactive input is a terminal
+    that understands the escape sequences it uses.
+************************************************************************/
+void openLineEditor(LineReader *reader){
+    char *term = getVariable("TERM");
+
+    if (term != NULL && strcmp(term, "dumb") == 0){
+        return;
+    }
+    if (tcgetattr(reader->fd, &line_editor.cooked) == -1){
+        return;
+    }
+    line_editor.cap = ARENA_MIN_SIZE;
+    line_editor.buf = malloc(line_editor.cap);
+    if (line_editor.buf == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    line_editor.enabled = true;
+}
+
+/**********************************************************************
+    Function: refreshLine(LineEditor *ed)
+
+    Redraws the prompt and the line being edited, scrolling the line
+    sideways when it is wider than the terminal.
+************************************************************************/
+void refreshLine(LineEditor *ed){
+    struct winsize size;
+    size_t columns = 80;
+    size_t start = 0, shown;
+    char tail[32];
+    struct iovec parts[3];
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 3){
+        columns = size.ws_col;
+    }
+
+    // Keep the cursor on screen: the prompt takes 2 columns.
+    if (ed->cursor > columns - 3){
+        start = ed->cursor - (columns - 3);
+    }
+    shown = ed->len - start;
+    if (shown > columns - 3){
+        shown = columns - 3;
+    }
+
+    parts[0] = (struct iovec){ "\r: ", 3 };
+    parts[1] = (struct iovec){ ed->buf + start, shown };
+    parts[2] = (struct iovec){ tail, snprintf(tail, sizeof(tail), "\x1b[K\r\x1b[%zuC", 2 + ed->cursor - start) };
+    writev(STDOUT_FILENO, parts, 3);
+}
+
+/**********************************************************************
+    Function: insertText(LineEditor *ed, const char *text, size_t n)
+
+    Inserts n bytes at the cursor and moves the cursor after them.
+************************************************************************/
+void insertText(LineEditor *ed, const char *text, size_t n){
+    if (ed->len + n + 1 > ed->cap){
+        size_t newCap = ed->cap * 2;
+        while (newCap < ed->len + n + 1){
+            newCap *= 2;
+        }
+        char *buf = realloc(ed->buf, newCap);
+        if (buf == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        ed->buf = buf;
+        ed->cap = newCap;
+    }
+    memmove(ed->buf + ed->cursor + n, ed->buf + ed->cursor, ed->len - ed->cursor);
+    memcpy(ed->buf + ed->cursor, text, n);
+    ed->cursor += n;
+    ed->len += n;
+}
+
+/**********************************************************************
+    Function: deleteText(LineEditor *ed, size_t from, size_t to)
+
+    Removes bytes [from, to) and leaves the cursor at from.
+************************************************************************/
+void deleteText(LineEditor *ed, size_t from, size_t to){
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->cursor = from;
+}
+
+/**********************************************************************
+    Function: insertEscaped(LineEditor *ed, const char *text)
+
+    Inserts completed text, backslash-escaping characters the parser
+    would otherwise treat specially.
+************************************************************************/
+void insertEscaped(LineEditor *ed, const char *text){
+    for (const char *p = text; *p != '\0'; p++){
+        if (word_special[(unsigned char)*p]){
+            insertText(ed, "\\", 1);
+        }
+        insertText(ed, p, 1);
+    }
+}
+
+/**********************************************************************
+    Function: listCompletions(LineEditor *ed, Completions *list)
+
+    Prints the candidates in columns below the line, then redraws it.
+************************************************************************/
+void listCompletions(LineEditor *ed, Completions *list){
+    struct winsize size;
+    int columns = 80, width = 0, perRow, shown = list->count > 200 ? 200 : list->count;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0){
+        columns = size.ws_col;
+    }
+    for (int i = 0; i < shown; i++){
+        int len = strlen(list->items[i].word) + (list->items[i].suffix == '/');
+        width = len > width ? len : width;
+    }
+    perRow = columns / (width + 2);
+    perRow = perRow > 0 ? perRow : 1;
+
+    printf("\n");
+    for (int i = 0; i < shown; i++){
+        Completion *item = &list->items[i];
+        printf("%s%-*s", item->word, (int)(width + 2 - strlen(item->word)), item->suffix == '/' ? "/" : "");
+        if ((i + 1) % perRow == 0 || i == shown - 1){
+            printf("\n");
+        }
+    }
+    if (shown < list->count){
+        printf("... and %d more\n", list->count - shown);
+    }
+    fflush(stdout);
+    refreshLine(ed);
+}
+
+/**********************************************************************
+    Function: completeWord(LineEditor *ed)
+
+    Tab completion of the word before the cursor. The first word of a
+    command is completed from the builtins and $PATH, other words (or
+    anything containing '/') as file names. A single match is typed
+    in full; several are typed up to their longest common prefix, and
+    listed when that adds nothing.
+************************************************************************/
+void completeWord(LineEditor *ed){
+    Completions list = {};
+    char prefix[PATH_MAX];
+    size_t start = ed->cursor, before, prefixLen = 0, common;
+
+    // Case -> The word starts after an unescaped blank or operator.
+    while (start > 0 && !(strchr(" \t|<>&;", ed->buf[start - 1]) && (start < 2 || ed->buf[start - 2] != '\\'))){
+        start--;
+    }
+    before = start;
+    while (before > 0 && (ed->buf[before - 1] == ' ' || ed->buf[before - 1] == '\t')){
+        before--;
+    }
+
+    // Undo backslash escapes so the prefix matches real names.
+    for (size_t i = start; i < ed->cursor; i++){
+        if (ed->buf[i] == '\\' && i + 1 < ed->cursor){
+            i++;
+        }
+        if (prefixLen + 1 >= sizeof(prefix)){
+            return;
+        }
+        prefix[prefixLen++] = ed->buf[i];
+    }
+    prefix[prefixLen] = '\0';
+
+    // Case -> Command position: start of line, or after |, ||, && or ;
+    if ((before == 0 || strchr("|&;", ed->buf[before - 1])) && strchr(prefix, '/') == NULL){
+        completeCommand(prefix, &list);
+    } else {
+        completeFile(prefix, &list);
+    }
+
+    if (list.count == 0){
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+
+    common = strlen(list.items[0].word);
+    for (int i = 1; i < list.count; i++){
+        size_t n = 0;
+        while (n < common && list.items[i].word[n] == list.items[0].word[n]){
+            n++;
+        }
+        common = n;
+    }
+
+    if (list.count == 1){
+        insertEscaped(ed, list.items[0].word + prefixLen);
+        insertText(ed, &list.items[0].suffix, 1);
+        refreshLine(ed);
+    } else if (common > prefixLen){
+        list.items[0].word[common] = '\0';
+        insertEscaped(ed, list.items[0].word + prefixLen);
+        refreshLine(ed);
+    } else {
+        listCompletions(ed, &list);
+    }
+
+    for (int i = 0; i < list.count; i++){
+        free(list.items[i].word);
+    }
+    free(list.items);
+}
+
+/**********************************************************************
+    Function: recallHistory(LineEditor *ed, int step)
+
+    Up (step -1) and Down (step 1): replaces the line with an earlier
+    or later history entry. Going down past the newest entry restores
+    what was being typed.
+************************************************************************/
+void recallHistory(LineEditor *ed, int step){
+    size_t pos;
+    const char *text;
+    size_t len;
+
+    if (history.header == NULL){
+        return;
+    }
+    if (ed->historyPos == SIZE_MAX){
+        indexHistory();
+        free(ed->saved);
+        ed->saved = strndup(ed->buf, ed->len);
+        ed->historyPos = history.count;
+    }
+    if ((step < 0 && ed->historyPos <= history.first) || (step > 0 && ed->historyPos >= history.count)){
+        return;
+    }
+    pos = ed->historyPos + step;
+
+    if (pos == history.count){
+        text = ed->saved ? ed->saved : "";
+        len = strlen(text);
+    } else {
+        HistoryRecord *record = historyRecord(history.index[pos]);
+        if (__atomic_load_n(&record->tag, __ATOMIC_ACQUIRE) != ~history.index[pos] || record->len > history.capacity){
+            return;
+        }
+        text = (char *)(record + 1);
+        len = record->len;
+    }
+
+    ed->historyPos = pos;
+    ed->len = 0;
+    ed->cursor = 0;
+    insertText(ed, text, len);
+    refreshLine(ed);
+}
+
+/**********************************************************************
+    Function: editorByte(ed, fd, sigFD, jobs, timeout)
+
+    Returns the next input byte for the editor, waiting up to timeout
+    ms (-1 for ever). While waiting, background jobs that finish are
+    reaped and announced, and the line is redrawn under them.
+
+    Returns:
+        The byte, -1 at end of input, or -2 on timeout.
+************************************************************************/
+int editorByte(LineEditor *ed, int fd, int sigFD, JobTable *jobs, int timeout){
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = sigFD, .events = POLLIN }
+    };
+    ssize_t n;
+
+    while (ed->pendingStart == ed->pendingLen){
+        int ready = poll(fds, 2, timeout);
+        if (ready == 0){
+            return -2;
+        }
+        if (ready == -1){
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN){
+            drainSignalFD(sigFD);
+            write(STDOUT_FILENO, "\r\x1b[K", 4);
+            reapBackground(jobs);
+            fflush(stdout);
+            refreshLine(ed);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+            n = read(fd, ed->pending, sizeof(ed->pending));
+            if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN)){
+                return -1;
+            }
+            ed->pendingStart = 0;
+            ed->pendingLen = n > 0 ? n : 0;
+        }
+    }
+    return (unsigned char)ed->pending[ed->pendingStart++];
+}
+
+/**********************************************************************
+    Function: editLine(LineReader *reader, int sigFD, JobTable *jobs)
+
+    Reads one line with the editor. Keys:
+        Left/Right, Ctrl-B/F    move        Home/End, Ctrl-A/E  line ends
+        Backspace, Delete       delete      Ctrl-K/U  kill to end/start
+        Ctrl-W                  kill word   Ctrl-L    clear screen
+        Up/Down, Ctrl-P/N       history     Tab       complete
+        Ctrl-C                  discard the line
+        Ctrl-D                  end of input on an empty line
+        Ctrl-Z                  SIGTSTP to the shell (foreground-only mode)
+
+    Returns:
+        The line, or NULL at end of input.
+************************************************************************/
+char *editLine(LineReader *reader, int sigFD, JobTable *jobs){
+    LineEditor *ed = &line_editor;
+    struct termios raw = ed->cooked;
+    char *line = ed->buf;
+    int c;
+
+    raw.c_iflag &= ~(ICRNL | INLCR | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(reader->fd, TCSANOW, &raw);
+
+    ed->len = 0;
+    ed->cursor = 0;
+    ed->historyPos = SIZE_MAX;
+
+    while (1){
+        c = editorByte(ed, reader->fd, sigFD, jobs, -1);
+        switch (c){
+
+            // Case -> End of input
+            case -1:
+                line = NULL;
+                goto done;
+
+            // Case -> Enter: the line is complete
+            case '\r':
+            case '\n':
+                goto done;
+
+            case 1:     // Ctrl-A
+                ed->cursor = 0;
+                break;
+            case 2:     // Ctrl-B
+                ed->cursor -= ed->cursor > 0;
+                break;
+            case 3:     // Ctrl-C
+                write(STDOUT_FILENO, "^C", 2);
+                ed->len = 0;
+                goto done;
+            case 4:     // Ctrl-D
+                if (ed->len == 0){
+                    line = NULL;
+                    goto done;
+                }
+                if (ed->cursor < ed->len){
+                    deleteText(ed, ed->cursor, ed->cursor + 1);
+                }
+                break;
+            case 5:     // Ctrl-E
+                ed->cursor = ed->len;
+                break;
+            case 6:     // Ctrl-F
+                ed->cursor += ed->cursor < ed->len;
+                break;
+            case 8:     // Ctrl-H
+            case 127:   // Backspace
+                if (ed->cursor > 0){
+                    deleteText(ed, ed->cursor - 1, ed->cursor);
+                }
+                break;
+            case '\t':
+                completeWord(ed);
+                continue;
+            case 11:    // Ctrl-K
+                ed->len = ed->cursor;
+                break;
+            case 12:    // Ctrl-L
+                write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+                break;
+            case 14:    // Ctrl-N
+                recallHistory(ed, 1);
+                continue;
+            case 16:    // Ctrl-P
+                recallHistory(ed, -1);
+                continue;
+            case 21:    // Ctrl-U
+                deleteText(ed, 0, ed->cursor);
+                break;
+            case 23: {  // Ctrl-W
+                size_t from = ed->cursor;
+                while (from > 0 && ed->buf[from - 1] == ' '){
+                    from--;
+                }
+                while (from > 0 && ed->buf[from - 1] != ' '){
+                    from--;
+                }
+                deleteText(ed, from, ed->cursor);
+                break;
+            }
+            case 26:    // Ctrl-Z
+                raise(SIGTSTP);
+                break;
+
+            // Case -> Escape sequence: arrows, Home, End, Delete
+            case 27: {
+                int seq[3] = { -2, -2, -2 };
+                for (int i = 0; i < 2; i++){
+                    seq[i] = editorByte(ed, reader->fd, sigFD, jobs, 50);
+                }
+                if (seq[0] != '[' && seq[0] != 'O'){
+                    break;
+                }
+                if (seq[1] >= '0' && seq[1] <= '9'){
+                    seq[2] = editorByte(ed, reader->fd, sigFD, jobs, 50);
+                    if (seq[2] != '~'){
+                        break;
+                    }
+                }
+                switch (seq[1]){
+                    case 'A':
+                        recallHistory(ed, -1);
+                        continue;
+                    case 'B':
+                        recallHistory(ed, 1);
+                        continue;
+                    case 'C':
+                        ed->cursor += ed->cursor < ed->len;
+                        break;
+                    case 'D':
+                        ed->cursor -= ed->cursor > 0;
+                        break;
+                    case 'H':
+                    case '1':
+                    case '7':
+                        ed->cursor = 0;
+                        break;
+                    case 'F':
+                    case '4':
+                    case '8':
+                        ed->cursor = ed->len;
+                        break;
+                    case '3':
+                        if (ed->cursor < ed->len){
+                            deleteText(ed, ed->cursor, ed->cursor + 1);
+                        }
+                        break;
+                }
+                break;
+            }
+
+            // Case -> Ordinary character
+            default:
+                if (c >= 32){
+                    char byte = c;
+                    insertText(ed, &byte, 1);
+                }
+                break;
+        }
+        refreshLine(ed);
+    }
+
+    done:
+    if (line != NULL){
+        line = ed->buf;
+        line[ed->len] = '\0';
+    }
+    write(STDOUT_FILENO, "\n", 1);
+    tcsetattr(reader->fd, TCSANOW, &ed->cooked);
+    return line;
+}
+
+/**********************************************************************
+    Function: openRedirects(Command *cmd, int *sourceFD, int *targetFD)
+
+    Opens the "<" and ">" files of a command in the parent. Output
+    files are created or truncated with mode 0644. Both descriptors are
+    O_CLOEXEC; launchStage dup2s them onto stdin/stdout in the child.
+
+    Args:
+        *cmd: parsed command.
+        *sourceFD, *targetFD: set to the opened fds, or -1 if the
+                               command has no such redirect.
+
+    Returns:
+        0 on success, -1 after printing an error (nothing left open).
+************************************************************************/
+int openRedirects(Command *cmd, int *sourceFD, int *targetFD){
+    *sourceFD = -1;
+    *targetFD = -1;
+
+    // Case -> Redirect Input found in command.
+    if (cmd->redir_path_in != NULL){
+        *sourceFD = open(cmd->redir_path_in, O_RDONLY | O_CLOEXEC);
+        if (*sourceFD == -1){
+            perror("source open()");
+            return -1;
+        }
+    }
+
+    // Case -> Redirect Output found in command.
+    if (cmd->redir_path_out != NULL){
+        *targetFD = open(cmd->redir_path_out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (*targetFD == -1){
+            perror("target open()");
+            if (*sourceFD != -1){
+                close(*sourceFD);
+                *sourceFD = -1;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: copyFile(int sourceFD, int targetFD)
+
+    Copies everything from sourceFD to targetFD inside the kernel.
+    copy_file_range is tried first (it can reflink or copy server side),
+    then sendfile, then a read/write loop for sources neither accepts,
+    such as a terminal. Each step continues from the current offsets.
+
+    Returns:
+        0 on success, -1 after printing an error.
+************************************************************************/
+int copyFile(int sourceFD, int targetFD){
+    char buf[READ_BUFFER_SIZE];
+    ssize_t n;
+
+    while ((n = copy_file_range(sourceFD, NULL, targetFD, NULL, COPY_CHUNK, 0)) > 0);
+    if (n == 0){
+        return 0;
+    }
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF){
+        perror("copy_file_range()");
+        return -1;
+    }
+
+    while ((n = sendfile(targetFD, sourceFD, NULL, COPY_CHUNK)) > 0);
+    if (n == 0){
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS){
+        perror("sendfile()");
+        return -1;
+    }
+
+    while ((n = read(sourceFD, buf, sizeof(buf))) != 0){
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("read()");
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ){
+            ssize_t written = write(targetFD, buf + done, n - done);
+            if (written == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                perror("write()");
+                return -1;
+            }
+            done += written;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: isFileCopy(Command *cmd)
+
+    True for foreground commands that only move bytes from one file to
+    the ">" file: "cat < a > b", "cat a > b", and "< a > b" with no
+    command at all, which runFileCopy copies like "cat < a > b" (as zsh
+    does with its default NULLCMD). Also true for a bare "> b" or "< a",
+    which have nothing to copy: the files are only opened, so "> b"
+    creates or truncates b.
+************************************************************************/
+bool isFileCopy(Command *cmd){
+    char **argv;
+
+    if (cmd->nstages != 1 || (cmd->background && !foreground_only_mode)){
+        return false;
+    }
+    if (cmd->argc == 0){
+        return cmd->redir_path_in != NULL || cmd->redir_path_out != NULL;
+    }
+    argv = stageArgv(cmd, 0);
+    if (strcmp(argv[0], "cat") != 0 || cmd->redir_path_out == NULL){
+        return false;
+    }
+    if (argv[1] == NULL){
+        return cmd->redir_path_in != NULL;
+    }
+    return argv[2] == NULL && argv[1][0] != '-' && cmd->redir_path_in == NULL;
+}
+
+/**********************************************************************
+    Function: addSelfUsage(Usage *usage, const struct rusage *before)
+
+    Adds the shell's own CPU time and page faults since before (taken
+    with getrusage(RUSAGE_SELF)) to usage, for work done in the shell.
+************************************************************************/
+void addSelfUsage(Usage *usage, const struct rusage *before){
+    struct rusage after, used = {};
+
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before->ru_utime, &used.ru_utime);
+    timersub(&after.ru_stime, &before->ru_stime, &used.ru_stime);
+    used.ru_minflt = after.ru_minflt - before->ru_minflt;
+    used.ru_majflt = after.ru_majflt - before->ru_majflt;
+    addUsage(usage, &used);
+}
+
+/**********************************************************************
+    Function: runFileCopy(cmd, *lastPID, *lastStatus, *lastUsage)
+
+    Runs a command accepted by isFileCopy in the shell itself, using
+    openRedirects so the files are opened exactly as for a child.
+    status then reports the shell's pid with 0 or 1 as the exit
+    status, and the shell's own CPU time for the copy.
+************************************************************************/
+void runFileCopy(Command *cmd, int *lastPID, int *lastStatus, Usage *lastUsage){
+    struct rusage before;
+    int sourceFD, targetFD;
+    int result = -1;
+
+    startUsage(lastUsage);
+    getrusage(RUSAGE_SELF, &before);
+
+    // "cat a > b" reads its argument as if it were "< a".
+    if (cmd->argc > 0 && stageArgv(cmd, 0)[1] != NULL){
+        cmd->redir_path_in = stageArgv(cmd, 0)[1];
+    }
+    if (openRedirects(cmd, &sourceFD, &targetFD) == 0){
+        result = 0;
+        if (sourceFD != -1 && targetFD != -1){
+            result = copyFile(sourceFD, targetFD);
+        }
+        if (sourceFD != -1){
+            close(sourceFD);
+        }
+        if (targetFD != -1){
+            close(targetFD);
+        }
+    }
+
+    addSelfUsage(lastUsage, &before);
+    *lastPID = getpid();
+    *lastStatus = W_EXITCODE(result == 0 ? 0 : EXIT_FAILURE, 0);
+}
+
+/**********************************************************************
+    Function: echoBuiltin(char **argv, FILE *out)
+
+    echo without fork: prints its arguments separated by spaces. A
+    leading "-n" drops the newline and "-E" is accepted; "-e" escapes
+    are left to the real echo.
+
+    Returns:
+        0, or -1 if the real program must run instead.
+************************************************************************/
+int echoBuiltin(char **argv, FILE *out){
+    bool newline = true;
+    int i = 1;
+
+    // Case -> Options: only words made entirely of n and E letters count.
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++){
+        if (argv[i][strspn(argv[i] + 1, "nEe") + 1] != '\0'){
+            break;
+        }
+        if (strchr(argv[i], 'e') != NULL){
+            return -1;
+        }
+        if (strchr(argv[i], 'n') != NULL){
+            newline = false;
+        }
+    }
+    if (out != NULL){
+        for (int first = i; argv[i] != NULL; i++){
+            if (i > first){
+                putc(' ', out);
+            }
+            fputs(argv[i], out);
+        }
+        if (newline){
+            putc('\n', out);
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: testUnary(const char *op, const char *arg)
+
+    Evaluates one of test's unary operators: the file tests -e -f -d
+    -r -w -x -s -L -h -b -c -p -S, -t FD, and the string tests -z -n.
+
+    Returns:
+        0 if true, 1 if false, -1 if op is not supported here.
+************************************************************************/
+int testUnary(const char *op, const char *arg){
+    struct stat st;
+    char *end;
+    long fd;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0'){
+        return -1;
+    }
+    switch (op[1]){
+        case 'z':
+            return arg[0] == '\0' ? 0 : 1;
+        case 'n':
+            return arg[0] != '\0' ? 0 : 1;
+        case 'r':
+            return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0 ? 0 : 1;
+        case 'w':
+            return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0 ? 0 : 1;
+        case 'x':
+            return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0 ? 0 : 1;
+        case 't':
+            fd = strtol(arg, &end, 10);
+            if (arg[0] == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX){
+                return -1;
+            }
+            return isatty((int)fd) ? 0 : 1;
+        case 'L':
+        case 'h':
+            return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+        case 'e':
+        case 'f':
+        case 'd':
+        case 's':
+        case 'b':
+        case 'c':
+        case 'p':
+        case 'S':
+            break;
+        default:
+            return -1;
+    }
+    if (stat(arg, &st) == -1){
+        return 1;
+    }
+    switch (op[1]){
+        case 'f': return S_ISREG(st.st_mode) ? 0 : 1;
+        case 'd': return S_ISDIR(st.st_mode) ? 0 : 1;
+        case 's': return st.st_size > 0 ? 0 : 1;
+        case 'b': return S_ISBLK(st.st_mode) ? 0 : 1;
+        case 'c': return S_ISCHR(st.st_mode) ? 0 : 1;
+        case 'p': return S_ISFIFO(st.st_mode) ? 0 : 1;
+        case 'S': return S_ISSOCK(st.st_mode) ? 0 : 1;
+        default:  return 0;
+    }
+}
+
+/**********************************************************************
+    Function: testBinary(const char *left, const char *op, const char *right)
+
+    Evaluates test's string operators = == != and integer operators
+    -eq -ne -lt -le -gt -ge.
+
+    Returns:
+        0 if true, 1 if false, -1 if op is not one of these or an
+        integer operand is malformed (the real test reports that).
+************************************************************************/
+int testBinary(const char *left, const char *op, const char *right){
+    char *end;
+    long long a, b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0){
+        return strcmp(left, right) == 0 ? 0 : 1;
+    }
+    if (strcmp(op, "!=") == 0){
+        return strcmp(left, right) != 0 ? 0 : 1;
+    }
+    if (op[0] != '-' || strlen(op) != 3){
+        return -1;
+    }
+
+    errno = 0;
+    a = strtoll(left, &end, 10);
+    if (left[0] == '\0' || *end != '\0' || errno != 0){
+        return -1;
+    }
+    b = strtoll(right, &end, 10);
+    if (right[0] == '\0' || *end != '\0' || errno != 0){
+        return -1;
+    }
+    if (strcmp(op, "-eq") == 0) return a == b ? 0 : 1;
+    if (strcmp(op, "-ne") == 0) return a != b ? 0 : 1;
+    if (strcmp(op, "-lt") == 0) return a < b ? 0 : 1;
+    if (strcmp(op, "-le") == 0) return a <= b ? 0 : 1;
+    if (strcmp(op, "-gt") == 0) return a > b ? 0 : 1;
+    if (strcmp(op, "-ge") == 0) return a >= b ? 0 : 1;
+    return -1;
+}
+
+/**********************************************************************
+    Function: testExpression(char **args, int n)
+
+    Evaluates a test expression of up to four words by the POSIX rules
+    for that many arguments: "!" negates, "( x )" groups, and three
+    words with a binary operator in the middle compare. Longer
+    expressions (-a, -o) are left to the real test.
+
+    Returns:
+        0 if true, 1 if false, -1 if not supported here.
+************************************************************************/
+int testExpression(char **args, int n){
+    int result;
+
+    switch (n){
+        case 0:
+            return 1;
+        case 1:
+            return args[0][0] != '\0' ? 0 : 1;
+        case 2:
+            if (strcmp(args[0], "!") == 0){
+                result = testExpression(args + 1, 1);
+                return result == -1 ? -1 : !result;
+            }
+            return testUnary(args[0], args[1]);
+        case 3:
+            result = testBinary(args[0], args[1], args[2]);
+            if (result != -1){
+                return result;
+            }
+            if (strcmp(args[0], "!") == 0){
+                result = testExpression(args + 1, 2);
+                return result == -1 ? -1 : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0){
+                return testExpression(args + 1, 1);
+            }
+            return -1;
+        case 4:
+            if (strcmp(args[0], "!") == 0){
+                result = testExpression(args + 1, 3);
+                return result == -1 ? -1 : !result;
+            }
+            if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0){
+                return testExpression(args + 1, 2);
+            }
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+/**********************************************************************
+    Function: printfArgument(char ***args)
+
+    Takes the next printf argument, or "" once they run out.
+************************************************************************/
+char *printfArgument(char ***args){
+    return **args != NULL ? *(*args)++ : "";
+}
+
+/**********************************************************************
+    Function: printfBuiltin(char **argv, FILE *out)
+
+    printf without fork. Handles the escapes \\ \a \b \f \n \r \t \v
+    and \NNN (octal) in the format, and %% plus the conversions
+    d i o u x X c s e E f g G with flags, width and precision. The
+    format is reused until every argument is consumed, and missing
+    arguments read as "" or 0, as in the real printf. With out NULL
+    the format and arguments are only checked.
+
+    Returns:
+        0, or -1 if the real program must run instead (other escapes
+        or conversions, "*" widths, or a malformed number).
+************************************************************************/
+int printfBuiltin(char **argv, FILE *out){
+    char **args;
+    char spec[32];
+
+    if (argv[1] == NULL || strcmp(argv[1], "--") == 0){
+        return -1;
+    }
+    args = argv + 2;
+    do {
+        char **started = args;
+
+        for (const char *f = argv[1]; *f != '\0'; f++){
+            // Case -> Backslash escape
+            if (*f == '\\'){
+                const char *escapes = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+                const char *found;
+                int c = 0;
+
+                if (f[1] >= '0' && f[1] <= '7'){
+                    for (int i = 0; i < 3 && f[1] >= '0' && f[1] <= '7'; i++){
+                        c = c * 8 + *++f - '0';
+                    }
+                } else if (f[1] != '\0' && (found = strchr(escapes, f[1])) != NULL && (found - escapes) % 2 == 0){
+                    c = found[1];
+                    f++;
+                } else {
+                    return -1;
+                }
+                if (out != NULL){
+                    putc(c, out);
+                }
+                continue;
+            }
+            if (*f != '%'){
+                if (out != NULL){
+                    putc(*f, out);
+                }
+                continue;
+            }
+            if (f[1] == '%'){
+                if (out != NULL){
+                    putc('%', out);
+                }
+                f++;
+                continue;
+            }
+
+            // Case -> Conversion: copy "%[flags][width][.precision]" into spec.
+            size_t len = 1 + strspn(f + 1, "-+ #0");
+            len += strspn(f + len, "0123456789");
+            if (f[len] == '.'){
+                len += 1 + strspn(f + len + 1, "0123456789");
+            }
+            if (len + 3 >= sizeof(spec) || f[len] == '\0' || strchr("diouxXcseEfgG", f[len]) == NULL){
+                return -1;
+            }
+            memcpy(spec, f, len);
+            char conversion = f[len];
+            char *arg = printfArgument(&args);
+            char *end;
+            f += len;
+
+            errno = 0;
+            if (conversion == 's' || conversion == 'c'){
+                // %c prints the first character of its argument.
+                char first[2] = { arg[0], '\0' };
+
+                strcpy(spec + len, "s");
+                if (out != NULL){
+                    fprintf(out, spec, conversion == 's' ? arg : first);
+                }
+            } else if (conversion == 'd' || conversion == 'i'){
+                long long value = arg[0] != '\0' ? strtoll(arg, &end, 0) : 0;
+
+                if ((arg[0] != '\0' && *end != '\0') || errno != 0){
+                    return -1;
+                }
+                snprintf(spec + len, sizeof(spec) - len, "ll%c", conversion);
+                if (out != NULL){
+                    fprintf(out, spec, value);
+                }
+            } else if (strchr("ouxX", conversion) != NULL){
+                unsigned long long value = arg[0] != '\0' ? strtoull(arg, &end, 0) : 0;
+
+                if ((arg[0] != '\0' && *end != '\0') || errno != 0){
+                    return -1;
+                }
+                snprintf(spec + len, sizeof(spec) - len, "ll%c", conversion);
+                if (out != NULL){
+                    fprintf(out, spec, value);
+                }
+            } else {
+                long double value = arg[0] != '\0' ? strtold(arg, &end) : 0;
+
+                if ((arg[0] != '\0' && *end != '\0') || errno != 0){
+                    return -1;
+                }
+                snprintf(spec + len, sizeof(spec) - len, "L%c", conversion);
+                if (out != NULL){
+                    fprintf(out, spec, value);
+                }
+            }
+        }
+
+        // Case -> A format without conversions is printed only once.
+        if (args == started){
+            break;
+        }
+    } while (*args != NULL);
+    return 0;
+}
+
+/**********************************************************************
+    Function: fastBuiltin(char **argv, FILE *out)
+
+    Runs echo, true, false, pwd, test, [ or printf inside the shell,
+    writing to out. With out NULL nothing is written and the result
+    only says whether the command can run here; test and [ still
+    evaluate, which is harmless since they only inspect.
+
+    Returns:
+        The exit code, or -1 if argv is not a fast builtin or uses an
+        option or form only the real program handles (--help,
+        --version, "echo -e", "test a -a b", ...).
+************************************************************************/
+int fastBuiltin(char **argv, FILE *out){
+    char cwd[PATH_MAX];
+    int argc = 0;
+
+    while (argv[argc] != NULL){
+        argc++;
+    }
+    if (argc > 1 && strncmp(argv[1], "--", 2) == 0 && argv[1][2] != '\0'){
+        return -1;
+    }
+
+    if (strcmp(argv[0], "true") == 0){
+        return 0;
+    } else if (strcmp(argv[0], "false") == 0){
+        return 1;
+    } else if (strcmp(argv[0], "echo") == 0){
+        return echoBuiltin(argv, out);
+    } else if (strcmp(argv[0], "printf") == 0){
+        return printfBuiltin(argv, out);
+    } else if (strcmp(argv[0], "test") == 0){
+        return testExpression(argv + 1, argc - 1);
+    } else if (strcmp(argv[0], "[") == 0){
+        if (strcmp(argv[argc - 1], "]") != 0){
+            return -1;
+        }
+        return testExpression(argv + 1, argc - 2);
+    } else if (strcmp(argv[0], "pwd") == 0){
+        if (argc > 1){
+            return -1;
+        }
+        if (out == NULL){
+            return 0;
+        }
+        if (getcwd(cwd, sizeof(cwd)) == NULL){
+            perror("pwd");
+            return 1;
+        }
+        fprintf(out, "%s\n", cwd);
+        return 0;
+    }
+    return -1;
+}
+
+/**********************************************************************
+    Function: isFastBuiltin(Command *cmd)
+
+    True for a single foreground command that fastBuiltin can run in
+    the shell, unless --external-builtins was given. A path such as
+    /bin/echo always runs the program.
+************************************************************************/
+bool isFastBuiltin(Command *cmd){
+    if (external_builtins || cmd->nstages != 1 || cmd->argc == 0 || (cmd->background && !foreground_only_mode)){
+        return false;
+    }
+    return fastBuiltin(stageArgv(cmd, 0), NULL) != -1;
+}
+
+/**********************************************************************
+    Function: runFastBuiltin(cmd, *lastPID, *lastStatus, *lastUsage)
+
+    Runs a command accepted by isFastBuiltin in the shell. The "<" and
+    ">" files are opened with openRedirects and swapped onto the
+    shell's stdin/stdout for the call, then the shell's own descriptors
+    are put back. status reports the shell's pid, as for runFileCopy.
+************************************************************************/
+void runFastBuiltin(Command *cmd, int *lastPID, int *lastStatus, Usage *lastUsage){
+    struct rusage before;
+    int sourceFD, targetFD;
+    int savedIn = -1, savedOut = -1;
+    int result = EXIT_FAILURE;
+
+    startUsage(lastUsage);
+    getrusage(RUSAGE_SELF, &before);
+
+    if (openRedirects(cmd, &sourceFD, &targetFD) == 0){
+        fflush(stdout);
+        if (sourceFD != -1){
+            savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(sourceFD, STDIN_FILENO);
+            close(sourceFD);
+        }
+        if (targetFD != -1){
+            savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(targetFD, STDOUT_FILENO);
+            close(targetFD);
+        }
+
+        result = fastBuiltin(stageArgv(cmd, 0), stdout);
+        if (fflush(stdout) == EOF || ferror(stdout)){
+            fprintf(stderr, "%s: write error: %s\n", stageArgv(cmd, 0)[0], strerror(errno));
+            clearerr(stdout);
+            result = EXIT_FAILURE;
+        }
+
+        // Case -> Put the shell's own stdin/stdout back.
+        if (savedIn != -1){
+            dup2(savedIn, STDIN_FILENO);
+            close(savedIn);
+        }
+        if (savedOut != -1){
+            dup2(savedOut, STDOUT_FILENO);
+            close(savedOut);
+        }
+    }
+
+    addSelfUsage(lastUsage, &before);
+    *lastPID = getpid();
+    *lastStatus = W_EXITCODE(result, 0);
+}
+
+/**********************************************************************
+    Function: spawnStage(argv, inFD, outFD, errFD, background)
+
+    Launches one command with posix_spawnp instead of fork/execvp.
+    inFD, outFD and errFD (-1 to inherit the shell's) are installed as
+    the child's stdin, stdout and stderr with dup2 file actions.
+
+    Child signal dispositions match the fork path:
+        SIGINT: reset to default for foreground children through the
+                spawn attributes, otherwise inherited as ignored.
+        SIGTSTP: ignored. Spawn attributes can only reset signals to
+                 default, so the parent briefly ignores SIGTSTP (with
+                 it blocked) while the child is created.
+
+    Returns:
+        pid of the child, or -1 after printing an error.
+************************************************************************/
+pid_t spawnStage(char **argv, int inFD, int outFD, int errFD, bool background){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    struct sigaction ignore = {}, saved;
+    sigset_t tstpMask, oldMask, childMask, defaults;
+    pid_t pid = -1;
+    char *path;
+    bool cached;
+    int err;
+
+    // dup2 clears O_CLOEXEC on the copy, the originals close at exec.
+    posix_spawn_file_actions_init(&actions);
+    if (inFD != -1){
+        posix_spawn_file_actions_adddup2(&actions, inFD, STDIN_FILENO);
+    }
+    if (outFD != -1){
+        posix_spawn_file_actions_adddup2(&actions, outFD, STDOUT_FILENO);
+    }
+    if (errFD != -1){
+        posix_spawn_file_actions_adddup2(&actions, errFD, STDERR_FILENO);
+    }
+
+    // Block SIGTSTP and ignore it so the child starts with it ignored.
+    sigemptyset(&tstpMask);
+    sigaddset(&tstpMask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &tstpMask, &oldMask);
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &ignore, &saved);
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    if (!background){
+        sigaddset(&defaults, SIGINT);
+    }
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    childMask = oldMask;
+    sigdelset(&childMask, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &childMask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    // Exec the cached location; unknown names go to posix_spawnp for its error.
+    path = findCommand(argv[0], &cached);
+    if (path != NULL){
+        err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    } else {
+        err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    }
+
+    // Case -> Cached location went stale: forget it and search PATH again
+    if (err == ENOENT && cached){
+        forgetCommand(argv[0]);
+        path = findCommand(argv[0], &cached);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, argv, environ) : ENOENT;
+    }
+
+    // Restore the SIGTSTP handler; a pending SIGTSTP is delivered now.
+    sigaction(SIGTSTP, &saved, NULL);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0){
+        errno = err;
+        perror("Execvp");
+        return -1;
+    }
+    TRACE(TRACE_EXEC, pid, 0);
+    return pid;
+}
+
+/**********************************************************************
+    Function: parseNice(const char *text, int *value)
+
+    Parses a nice value, an integer from -20 to 19.
+
+    Returns:
+        0 on success, -1 if text is not a nice value.
+************************************************************************/
+int parseNice(const char *text, int *value){
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || n < -20 || n > 19){
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+/**********************************************************************
+    Function: parseSize(const char *text, unsigned long long *value)
+
+    Parses a byte count or plain number with an optional K, M or G
+    suffix (powers of 1024).
+
+    Returns:
+        0, or -1 if text is not a number.
+************************************************************************/
+int parseSize(const char *text, unsigned long long *value){
+    char *end;
+
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    if (end == text || errno != 0 || text[0] == '-'){
+        return -1;
+    }
+    switch (*end){
+        case 'G': case 'g': *value <<= 10; // fall through
+        case 'M': case 'm': *value <<= 10; // fall through
+        case 'K': case 'k': *value <<= 10; end++; break;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/**********************************************************************
+    Function: parseCpuList(const char *text, cpu_set_t *cpus)
+
+    Parses a CPU list such as "0", "0,2" or "1-3,6" into cpus.
+
+    Returns:
+        0, or -1 if the list is malformed or names no CPU.
+************************************************************************/
+int parseCpuList(const char *text, cpu_set_t *cpus){
+    const char *p = text;
+
+    CPU_ZERO(cpus);
+    while (*p != '\0'){
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0){
+            return -1;
+        }
+        last = first;
+        if (*end == '-'){
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first){
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE){
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++){
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',' && end[1] != '\0'){
+            end++;
+        } else if (*end != '\0'){
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/**********************************************************************
+    Function: parseLimits(Command *cmd)
+
+    Takes the job prefixes off the front of cmd's first stage and
+    records them in cmd->limits:
+
+        pin CPUS cmd ...            run on CPUS ("0", "0,2", "1-3")
+        limit KEY=VALUE... cmd ...  with KEY one of
+            nice     nice level, -20..19
+            as       RLIMIT_AS, bytes (K/M/G suffixes)
+            cpu      RLIMIT_CPU, seconds
+            nofile   RLIMIT_NOFILE
+            mem      cgroup v2 memory.max, bytes
+            cpumax   cgroup v2 cpu.max, QUOTA[/PERIOD] microseconds
+
+    Prefixes can be repeated and combined ("pin 2 limit nice=10 make").
+
+    Returns:
+        0, or -1 after printing an error (nothing is launched).
+************************************************************************/
+int parseLimits(Command *cmd){
+    JobLimits *limits = &cmd->limits;
+    char **argv;
+    int used = 0;
+
+    limits->active = false;
+    limits->pinned = false;
+    limits->niced = false;
+    limits->nrlimits = 0;
+    limits->memoryMax = NULL;
+    limits->cpuMax = NULL;
+    limits->cgroup[0] = '\0';
+    if (cmd->argc == 0){
+        return 0;
+    }
+    argv = cmd->argv + cmd->stages[0];
+
+    while (argv[used] != NULL){
+        // Case -> pin CPUS
+        if (strcmp(argv[used], "pin") == 0){
+            if (argv[used + 1] == NULL || parseCpuList(argv[used + 1], &limits->cpus) == -1){
+                fprintf(stderr, "pin: usage: pin CPUS command ...\n");
+                return -1;
+            }
+            limits->pinned = true;
+            used += 2;
+
+        // Case -> limit KEY=VALUE...
+        } else if (strcmp(argv[used], "limit") == 0){
+            used++;
+            while (argv[used] != NULL && strchr(argv[used], '=') != NULL){
+                char *key = argv[used], *value = strchr(key, '=') + 1;
+                unsigned long long number;
+                int resource = -1;
+
+                if (strncmp(key, "nice=", 5) == 0 && parseNice(value, &limits->nice) == 0){
+                    limits->niced = true;
+                } else if (strncmp(key, "mem=", 4) == 0 && parseSize(value, &number) == 0){
+                    limits->memoryMax = value;
+                } else if (strncmp(key, "cpumax=", 7) == 0 && value[0] != '\0'){
+                    limits->cpuMax = value;
+                } else if (strncmp(key, "as=", 3) == 0){
+                    resource = RLIMIT_AS;
+                } else if (strncmp(key, "cpu=", 4) == 0){
+                    resource = RLIMIT_CPU;
+                } else if (strncmp(key, "nofile=", 7) == 0){
+                    resource = RLIMIT_NOFILE;
+                } else {
+                    fprintf(stderr, "limit: bad limit '%s'\n", key);
+                    return -1;
+                }
+
+                if (resource != -1){
+                    if (parseSize(value, &number) == -1 || limits->nrlimits == 3){
+                        fprintf(stderr, "limit: bad limit '%s'\n", key);
+                        return -1;
+                    }
+                    limits->rlimits[limits->nrlimits].resource = resource;
+                    limits->rlimits[limits->nrlimits].value = number;
+                    limits->nrlimits++;
+                }
+                used++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (used > 0 && argv[used] == NULL){
+        fprintf(stderr, "%s: missing command\n", argv[0]);
+        return -1;
+    }
+    cmd->stages[0] += used;
+    limits->active = limits->pinned || limits->niced || limits->nrlimits > 0 ||
+                     limits->memoryMax != NULL || limits->cpuMax != NULL;
+    return 0;
+}
+
+/**********************************************************************
+    Function: autoPin(JobLimits *limits)
+
+    --autopin: pins a background job that has no "pin" prefix to the
+    next of the shell's CPUs, round-robin.
+************************************************************************/
+void autoPin(JobLimits *limits){
+    cpu_set_t allowed;
+    int count, pick;
+
+    if (limits->pinned || sched_getaffinity(0, sizeof(allowed), &allowed) == -1){
+        return;
+    }
+    count = CPU_COUNT(&allowed);
+    pick = auto_pin_next++ % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if (CPU_ISSET(cpu, &allowed) && pick-- == 0){
+            CPU_ZERO(&limits->cpus);
+            CPU_SET(cpu, &limits->cpus);
+            limits->pinned = true;
+            limits->active = true;
+            return;
+        }
+    }
+}
+
+/**********************************************************************
+    Function: writeCgroupFile(const char *dir, const char *name, const char *text)
+    Writes text to the control file dir/name.
+
+    Returns:
+        0, or -1 after printing an error.
+************************************************************************/
+int writeCgroupFile(const char *dir, const char *name, const char *text){
+    char path[PATH_MAX + 32];
+    int fd, result = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, text, strlen(text)) == -1){
+        perror(path);
+        result = -1;
+    }
+    if (fd != -1){
+        close(fd);
+    }
+    return result;
+}
+
+/**********************************************************************
+    Function: openJobCgroup(JobLimits *limits)
+
+    Makes a cgroup v2 directory for one job under the shell's own
+    cgroup, named smallsh-PID-N, and writes its memory.max and
+    cpu.max. The controllers must already be enabled for the shell's
+    cgroup (cgroup.subtree_control) and the directory writable.
+
+    Returns:
+        0, or -1 after printing an error (the directory is removed).
+************************************************************************/
+int openJobCgroup(JobLimits *limits){
+    static unsigned int sequence = 0;
+    const char *root = "/sys/fs/cgroup";
+    char line[PATH_MAX], text[64];
+    char *own = NULL;
+    FILE *self;
+
+    // Case -> Hybrid hierarchy: the v2 tree is mounted under unified/
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == -1){
+        root = "/sys/fs/cgroup/unified";
+    }
+    self = fopen("/proc/self/cgroup", "re");
+    while (self != NULL && fgets(line, sizeof(line), self) != NULL){
+        if (strncmp(line, "0::", 3) == 0){
+            own = line + 3;
+            own[strcspn(own, "\n")] = '\0';
+            break;
+        }
+    }
+    if (self != NULL){
+        fclose(self);
+    }
+    if (own == NULL){
+        fprintf(stderr, "limit: no cgroup v2 hierarchy\n");
+        return -1;
+    }
+
+    if (snprintf(limits->cgroup, sizeof(limits->cgroup), "%s%s/smallsh-%d-%u", root,
+                 strcmp(own, "/") == 0 ? "" : own, (int)getpid(), ++sequence) >= (int)sizeof(limits->cgroup)){
+        fprintf(stderr, "limit: cgroup path too long\n");
+        limits->cgroup[0] = '\0';
+        return -1;
+    }
+    if (mkdir(limits->cgroup, 0755) == -1){
+        perror(limits->cgroup);
+        limits->cgroup[0] = '\0';
+        return -1;
+    }
+
+    if (limits->memoryMax != NULL){
+        unsigned long long bytes;
+        parseSize(limits->memoryMax, &bytes);
+        snprintf(text, sizeof(text), "%llu", bytes);
+        if (writeCgroupFile(limits->cgroup, "memory.max", text) == -1){
+            goto failed;
+        }
+    }
+    if (limits->cpuMax != NULL){
+        char *slash = strchr(limits->cpuMax, '/');
+        snprintf(text, sizeof(text), "%.*s %s", slash ? (int)(slash - limits->cpuMax) : (int)strlen(limits->cpuMax),
+                 limits->cpuMax, slash ? slash + 1 : "100000");
+        if (writeCgroupFile(limits->cgroup, "cpu.max", text) == -1){
+            goto failed;
+        }
+    }
+    return 0;
+
+failed:
+    rmdir(limits->cgroup);
+    limits->cgroup[0] = '\0';
+    return -1;
+}
+
+/**********************************************************************
+    Function: applyLimits(const JobLimits *limits)
+
+    Run by a forked child before exec: joins the job's cgroup, then
+    sets the CPU mask, nice level and rlimits.
+
+    Returns:
+        0, or -1 after printing an error (the child then exits).
+************************************************************************/
+int applyLimits(const JobLimits *limits){
+    if (limits->cgroup[0] != '\0' && writeCgroupFile(limits->cgroup, "cgroup.procs", "0") == -1){
+        return -1;
+    }
+    if (limits->pinned && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) == -1){
+        perror("sched_setaffinity()");
+        return -1;
+    }
+    if (limits->niced && setpriority(PRIO_PROCESS, 0, limits->nice) == -1){
+        perror("setpriority()");
+        return -1;
+    }
+    for (int i = 0; i < limits->nrlimits; i++){
+        struct rlimit rl = { limits->rlimits[i].value, limits->rlimits[i].value };
+        if (setrlimit(limits->rlimits[i].resource, &rl) == -1){
+            perror("setrlimit()");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: forkStage(argv, inFD, outFD, errFD, background, limits)
+
+    Launches one command with the original fork/execvp path. inFD,
+    outFD and errFD (-1 to inherit) become the child's stdin, stdout
+    and stderr. limits, if not NULL, is applied in the child before
+    exec.
+
+    Returns:
+        pid of the child, or -1 if fork failed.
+************************************************************************/
+pid_t forkStage(char **argv, int inFD, int outFD, int errFD, bool background, const JobLimits *limits){
+    struct sigaction SIGINT_action = {};
+    struct sigaction SIGTSTP_action = {};
+    sigset_t childMask;
+    char *path = findLaunchCommand(argv[0]);
+    pid_t childPid = fork();
+
+    switch(childPid){
+
+        // Case -> Fork error
+        case -1:
+            perror("fork() failed.");
+            return -1;
+
+        // Case -> Child Process
+        case 0:
+
+            /*--------------------------------------------------------------------
+              Signal Handling For Child Processes:
+                1. SIGINT (Child is Background): Ignore (Inherited from Parent)
+                2. SIGINT (Child is Foreground): Default (Set here)
+                3. SIGTSP (All Children): Ignore (Set here)
+            ---------------------------------------------------------------------*/
+
+            // Ignore SIGTSTP
+            SIGTSTP_action.sa_handler = SIG_IGN;
+            sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+
+            // Set Default Handling for SIG_INT if this is a foreground process only.
+            if (!background){
+                SIGINT_action.sa_handler = SIG_DFL;
+                sigaction(SIGINT, &SIGINT_action, NULL);
+            }
+
+            // SIGCHLD is blocked in the shell for its signalfd
+            sigemptyset(&childMask);
+            sigaddset(&childMask, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &childMask, NULL);
+
+            /*-------------------------------------------------
+             Handle Redirects and execute.
+
+             The redirect files and pipe ends were opened by
+             the parent. Here they replace the stdin and stdout
+             streams prior to calling execvp.
+            -------------------------------------------------*/
+            if (inFD != -1 && dup2(inFD, STDIN_FILENO) == -1){
+                perror("target dup2() - Source");
+                exit(EXIT_FAILURE);
+            }
+            if (outFD != -1 && dup2(outFD, STDOUT_FILENO) == -1){
+                perror("target dup2() - Destination");
+                exit(EXIT_FAILURE);
+            }
+            if (errFD != -1 && dup2(errFD, STDERR_FILENO) == -1){
+                perror("target dup2() - Error");
+                exit(EXIT_FAILURE);
+            }
+            if (limits != NULL && applyLimits(limits) == -1){
+                exit(EXIT_FAILURE);
+            }
+
+            // Execute the command, falling back to a PATH search if the cached path is gone
+            TRACE(TRACE_EXEC, getpid(), 0);
+            if (path != NULL){
+                execve(path, argv, environ);
+            }
+            execvp(argv[0], argv);
+            perror("Execvp");
+            exit(EXIT_FAILURE);
+
+        // Case -> Parent Process
+        default:
+            return childPid;
+    }
+}
+
+/**********************************************************************
+    Function: runZygote(int fd)
+
+    Main loop of the zygote, the helper behind --launch=zygote. It is
+    the shell binary re-executed with "--zygote" at startup, so its
+    address space stays a few pages however large the shell grows,
+    and forking it costs the same for every command.
+
+    Each request on fd (a SOCK_SEQPACKET socket) is forked with
+    CLONE_PARENT, which makes the command a child of the shell rather
+    than of the zygote: the shell waits for it, gets its SIGCHLD and
+    its rusage exactly as for the other backends. The child moves to
+    the shell's working directory, installs the stdio descriptors and
+    sets SIGINT and SIGTSTP as forkStage does before exec.
+
+    Returns:
+        EXIT_SUCCESS once the shell closes its end.
+************************************************************************/
+int runZygote(int fd){
+    static char buffer[ZYGOTE_MAX_REQUEST + 1];
+    char control[CMSG_SPACE(4 * sizeof(int))];
+    struct sigaction ignore = {};
+    char **argv = NULL;
+    int argvCap = 0;
+
+    // The zygote itself ignores the terminal's ^C and ^Z.
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore, NULL);
+    sigaction(SIGTSTP, &ignore, NULL);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    while (1){
+        struct iovec iov = { buffer, ZYGOTE_MAX_REQUEST };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = control, .msg_controllen = sizeof(control) };
+        struct cmsghdr *cmsg;
+        ZygoteRequest req;
+        int fds[4], nfds = 0, stdio[3] = { -1, -1, -1 };
+        char *path, *next, *end;
+        pid_t pid = -EINVAL;
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+        if (n == -1 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return EXIT_SUCCESS;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS){
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+        memcpy(&req, buffer, sizeof(req));
+        buffer[n] = '\0';
+        end = buffer + n;
+
+        // Unpack the path and argv; a malformed request is answered with -EINVAL.
+        path = buffer + sizeof(req);
+        next = path + strlen(path) + 1;
+        if (req.argc + 1 > argvCap){
+            argvCap = req.argc + 1;
+            argv = realloc(argv, argvCap * sizeof(char *));
+        }
+        for (int i = 0; i < req.argc && next < end; i++){
+            argv[i] = next;
+            next += strlen(next) + 1;
+            argv[i + 1] = NULL;
+        }
+        for (int i = 0, j = 1; i < 3; i++){
+            if (req.fdMask & (1 << i)){
+                stdio[i] = j < nfds ? fds[j++] : -1;
+            }
+        }
+
+        if (nfds > 0 && req.argc > 0 && next <= end){
+            pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+            if (pid == 0){
+                // Case -> Child: foreground commands take SIGINT, SIGTSTP stays ignored
+                if (!req.background){
+                    struct sigaction dfl = {};
+                    dfl.sa_handler = SIG_DFL;
+                    sigaction(SIGINT, &dfl, NULL);
+                }
+                if (fchdir(fds[0]) == -1){
+                    perror("fchdir()");
+                    _exit(EXIT_FAILURE);
+                }
+                for (int i = 0; i < 3; i++){
+                    if (stdio[i] != -1 && dup2(stdio[i], i) == -1){
+                        perror("dup2()");
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+                if (path[0] != '\0'){
+                    execve(path, argv, environ);
+                }
+                execvp(argv[0], argv);
+                perror("Execvp");
+                _exit(EXIT_FAILURE);
+            }
+            if (pid == -1){
+                pid = -errno;
+            }
+        }
+
+        for (int i = 0; i < nfds; i++){
+            close(fds[i]);
+        }
+        send(fd, &pid, sizeof(pid), MSG_NOSIGNAL);
+    }
+}
+
+/**********************************************************************
+    Function: startZygote()
+
+    Starts the zygote for --launch=zygote: "/proc/self/exe --zygote"
+    with one end of a socketpair as its fd 3, and the current environ,
+    which its commands inherit. Called at startup, and again by
+    zygoteStage whenever syncEnviron() has rebuilt environ.
+
+    Returns:
+        0, or -1 after printing an error (the shell then uses spawn).
+************************************************************************/
+int startZygote(void){
+    char *argv[] = { "smallsh", "--zygote", NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    int fds[2];
+    int err;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1){
+        perror("socketpair()");
+        return -1;
+    }
+
+    // dup2 onto ZYGOTE_FD clears O_CLOEXEC, even when fds[1] is already 3.
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], ZYGOTE_FD);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    err = posix_spawn(&zygote_pid, "/proc/self/exe", &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (err != 0){
+        errno = err;
+        perror("zygote");
+        close(fds[0]);
+        return -1;
+    }
+    zygote_fd = fds[0];
+    zygote_generation = variables.generation;
+    return 0;
+}
+
+/**********************************************************************
+    Function: zygoteStage(argv, inFD, outFD, errFD, background)
+
+    Launches one command through the zygote. inFD, outFD and errFD
+    (-1 to inherit) become the child's stdin, stdout and stderr.
+    Requests larger than ZYGOTE_MAX_REQUEST go to spawnStage, as do
+    all commands once the zygote has gone away.
+
+    Returns:
+        pid of the child, or -1 after printing an error.
+************************************************************************/
+pid_t zygoteStage(char **argv, int inFD, int outFD, int errFD, bool background){
+    char buffer[ZYGOTE_MAX_REQUEST];
+    char control[CMSG_SPACE(4 * sizeof(int))] = {};
+    ZygoteRequest req = { .background = background };
+    int fds[4], nfds = 1, stdio[3] = { inFD, outFD, errFD };
+    size_t len = sizeof(req);
+    char *path = findLaunchCommand(argv[0]);
+    pid_t pid;
+
+    // Case -> Exported variables changed: restart the zygote with the new environ
+    if (zygote_fd != -1 && zygote_generation != variables.generation){
+        stopZygote();
+        startZygote();
+    }
+
+    // Case -> Pack the path and argv; fall back when they don't fit
+    if (path == NULL){
+        path = "";
+    }
+    for (int i = -1; zygote_fd != -1 && (i == -1 || argv[i] != NULL); i++){
+        const char *arg = i == -1 ? path : argv[i];
+        size_t argLen = strlen(arg) + 1;
+
+        if (len + argLen > sizeof(buffer)){
+            return spawnStage(argv, inFD, outFD, errFD, background);
+        }
+        memcpy(buffer + len, arg, argLen);
+        len += argLen;
+        req.argc = i + 1;
+    }
+    if (zygote_fd == -1){
+        return spawnStage(argv, inFD, outFD, errFD, background);
+    }
+
+    fds[0] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[0] == -1){
+        return spawnStage(argv, inFD, outFD, errFD, background);
+    }
+    for (int i = 0; i < 3; i++){
+        if (stdio[i] != -1){
+            req.fdMask |= 1 << i;
+            fds[nfds++] = stdio[i];
+        }
+    }
+    memcpy(buffer, &req, sizeof(req));
+
+    struct iovec iov = { buffer, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) == -1 || recv(zygote_fd, &pid, sizeof(pid), 0) != sizeof(pid)){
+        // Case -> Zygote is gone: launch everything with posix_spawn from now on
+        perror("zygote");
+        close(fds[0]);
+        stopZygote();
+        return spawnStage(argv, inFD, outFD, errFD, background);
+    }
+    close(fds[0]);
+
+    if (pid < 0){
+        errno = -pid;
+        perror("clone()");
+        return -1;
+    }
+    TRACE(TRACE_EXEC, pid, 0);
+    return pid;
+}
+
+/**********************************************************************
+    Function: launchStage(argv, inFD, outFD, errFD, background, limits)
+
+    Launches one command with the backend selected by --launch, or
+    with forkStage when limits (may be NULL) has anything to apply,
+    and traces the launch.
+************************************************************************/
+pid_t launchStage(char **argv, int inFD, int outFD, int errFD, bool background, const JobLimits *limits){
+    LaunchBackend backend = (limits != NULL && limits->active) ? LAUNCH_FORK : launch_backend;
+    pid_t pid;
+
+    if (backend == LAUNCH_SPAWN){
+        pid = spawnStage(argv, inFD, outFD, errFD, background);
+    } else if (backend == LAUNCH_ZYGOTE){
+        pid = zygoteStage(argv, inFD, outFD, errFD, background);
+    } else {
+        pid = forkStage(argv, inFD, outFD, errFD, background, limits);
+    }
+    TRACE(TRACE_LAUNCH, pid, backend);
+    return pid;
+}
+
+/**********************************************************************
+    Function: checkArgMax(Command *cmd)
+
+    Checks each stage's argument list against what execve accepts: the
+    argument and environment strings plus their pointers must fit in
+    sysconf(_SC_ARG_MAX), and no single string may exceed
+    ARG_STRLEN_PAGES pages. The environment is measured once per
+    syncEnviron rebuild, so the check is linear in the command line.
+
+    Returns:
+        0 if every stage fits, -1 after printing which one does not.
+************************************************************************/
+int checkArgMax(Command *cmd){
+    if (arg_max == 0){
+        arg_max = sysconf(_SC_ARG_MAX);
+        arg_strlen_max = ARG_STRLEN_PAGES * sysconf(_SC_PAGESIZE);
+    }
+    if (variables.envBytes == 0 || variables.envGeneration != variables.generation){
+        variables.envBytes = sizeof(char *);
+        for (char **env = environ; *env != NULL; env++){
+            variables.envBytes += strlen(*env) + 1 + sizeof(char *);
+        }
+        variables.envGeneration = variables.generation;
+    }
+
+    for (int i = 0; i < cmd->nstages; i++){
+        char **argv = stageArgv(cmd, i);
+        size_t total = variables.envBytes + sizeof(char *);
+
+        for (char **arg = argv; *arg != NULL; arg++){
+            size_t len = strlen(*arg) + 1;
+
+            if (len > arg_strlen_max){
+                fprintf(stderr, "smallsh: %s: argument of %zu bytes is too long (limit %zu)\n", argv[0], len - 1, arg_strlen_max - 1);
+                return -1;
+            }
+            total += len + sizeof(char *);
+        }
+        if (total > arg_max){
+            fprintf(stderr, "smallsh: %s: argument list too long (%zu bytes with the environment, limit %zu)\n", argv[0], total, arg_max);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: launchPipeline(Command *cmd, bool background, const int *stdio)
+
+    Launches every stage of cmd, one process per stage, connected by
+    pipe2(O_CLOEXEC) pipes. The "<" file is the first stage's stdin and
+    the ">" file the last stage's stdout; they are handed to the stages
+    directly, so data from a regular file never passes through the
+    shell. cmd->pids[i] is set to each stage's pid, or -1 if that stage
+    could not be started (its neighbours still run and see EOF/EPIPE).
+
+    Leading "limit" and "pin" words are taken off first (parseLimits)
+    and apply to every stage. Argument lists execve would refuse with
+    E2BIG are reported by checkArgMax before anything starts.
+
+    stdio, if not NULL, holds the stdin, stdout and stderr to use
+    instead of the shell's own wherever no redirect or pipe applies.
+    They stay open; the server passes each client's descriptors here.
+
+    Returns:
+        0 if the pipeline was started, -1 if a prefix was malformed, an
+        argument list was too long, or a redirect, cgroup or pipe could
+        not be opened (nothing left running: stages started before a
+        failed pipe2 are killed and reaped).
+************************************************************************/
+int launchPipeline(Command *cmd, bool background, const int *stdio){
+    int sourceFD, targetFD;
+    int pipeFDs[2];
+    int inFD, outFD;
+    int defaults[3] = { -1, -1, -1 };
+
+    if (stdio != NULL){
+        memcpy(defaults, stdio, sizeof(defaults));
+    }
+
+    // Children get the exported variables as of now.
+    syncEnviron();
+
+    // "limit"/"pin" prefixes; a cgroup is made up front for the children to join.
+    if (parseLimits(cmd) == -1 || checkArgMax(cmd) == -1){
+        return -1;
+    }
+    if (background && auto_pin){
+        autoPin(&cmd->limits);
+    }
+    if ((cmd->limits.memoryMax != NULL || cmd->limits.cpuMax != NULL) && openJobCgroup(&cmd->limits) == -1){
+        return -1;
+    }
+
+    if (openRedirects(cmd, &sourceFD, &targetFD) == -1){
+        if (cmd->limits.cgroup[0] != '\0'){
+            rmdir(cmd->limits.cgroup);
+        }
+        return -1;
+    }
+
+    inFD = sourceFD;
+    for (int i = 0; i < cmd->nstages; i++){
+        pipeFDs[0] = -1;
+        pipeFDs[1] = -1;
+
+        // Every stage but the last writes into a new pipe.
+        if (i < cmd->nstages - 1){
+            if (pipe2(pipeFDs, O_CLOEXEC) == -1){
+                // Case -> No pipe: the pipeline can't be wired up, undo the stages started so far.
+                perror("pipe2()");
+                if (inFD != -1){
+                    close(inFD);
+                }
+                if (targetFD != -1){
+                    close(targetFD);
+                }
+                for (int j = 0; j < i; j++){
+                    if (cmd->pids[j] != -1){
+                        kill(cmd->pids[j], SIGKILL);
+                        waitpid(cmd->pids[j], NULL, 0);
+                    }
+                }
+                if (cmd->limits.cgroup[0] != '\0'){
+                    rmdir(cmd->limits.cgroup);
+                }
+                return -1;
+            } else if (pipe_size > 0 && fcntl(pipeFDs[1], F_SETPIPE_SZ, pipe_size) == -1){
+                perror("fcntl(F_SETPIPE_SZ)");
+            }
+            outFD = pipeFDs[1];
+        } else {
+            outFD = targetFD;
+        }
+
+        cmd->pids[i] = launchStage(stageArgv(cmd, i),
+                                   (i == 0 && inFD == -1) ? defaults[0] : inFD,
+                                   (i == cmd->nstages - 1 && outFD == -1) ? defaults[1] : outFD,
+                                   defaults[2], background, &cmd->limits);
+
+        // The parent keeps only the read end for the next stage.
+        if (inFD != -1){
+            close(inFD);
+        }
+        if (outFD != -1){
+            close(outFD);
+        }
+        inFD = pipeFDs[0];
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: nextLine(LineReader *reader)
+
+    Returns the next complete line already buffered in reader with its
+    newline replaced by NUL, or NULL if more input is needed. At end of
+    input the unterminated remainder is returned. Lines are never
+    split: fillLineReader grows the buffer until a long one fits.
+************************************************************************/
+char *nextLine(LineReader *reader){
+    char *line = reader->buf + reader->start;
+    size_t avail = reader->len - reader->start;
+    char *newline = memchr(line, '\n', avail);
+
+    if (newline != NULL){
+        *newline = '\0';
+        reader->start += newline - line + 1;
+        return line;
+    }
+
+    // Case -> Last line without newline
+    if (reader->eof && avail > 0){
+        line[avail] = '\0';
+        reader->start = reader->len;
+        return line;
+    }
+    return NULL;
+}
+
+/**********************************************************************
+    Function: fillLineReader(LineReader *reader)
+
+    Moves unread bytes to the front of the buffer and reads more input
+    after them, doubling the buffer first if a partial line fills it.
+    Sets reader->eof when read returns 0.
+************************************************************************/
+void fillLineReader(LineReader *reader){
+    size_t avail = reader->len - reader->start;
+    ssize_t n;
+
+    memmove(reader->buf, reader->buf + reader->start, avail);
+    reader->start = 0;
+    reader->len = avail;
+
+    // Case -> One line fills the buffer: grow it, one byte kept for the NUL.
+    if (reader->len == reader->cap){
+        char *buf = realloc(reader->buf, reader->cap * 2 + 1);
+        if (buf == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        reader->buf = buf;
+        reader->cap *= 2;
+    }
+
+    n = read(reader->fd, reader->buf + reader->len, reader->cap - reader->len);
+    if (n == 0){
+        reader->eof = true;
+    } else if (n > 0){
+        reader->len += n;
+    } else if (errno != EINTR && errno != EAGAIN){
+        perror("read()");
+        reader->eof = true;
+    }
+}
+
+/**********************************************************************
+    Function: mapScript(LineReader *reader)
+
+    Maps the whole of a regular-file input into memory, privately and
+    writable so nextLine can terminate lines in place. The mapping is
+    placed inside an anonymous reservation one byte longer than the
+    file, so a final line without a newline can still be terminated
+    even when the file ends on a page boundary.
+
+    Returns:
+        true if reader now holds the whole file.
+************************************************************************/
+bool mapScript(LineReader *reader){
+    struct stat info;
+    char *area;
+
+    if (fstat(reader->fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0){
+        return false;
+    }
+
+    area = mmap(NULL, info.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED){
+        return false;
+    }
+    if (mmap(area, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, reader->fd, 0) == MAP_FAILED){
+        munmap(area, info.st_size + 1);
+        return false;
+    }
+
+    reader->buf = area;
+    reader->len = info.st_size;
+    reader->cap = info.st_size;
+    reader->mapped = true;
+    reader->eof = true;
+
+    // Leave the offset at the end, as if the script had been read.
+    lseek(reader->fd, 0, SEEK_END);
+    return true;
+}
+
+/**********************************************************************
+    Function: openLineReader(LineReader *reader, char *script)
+
+    Sets up command input. With a script path the script is read;
+    otherwise stdin is. Input is interactive (prompted) only when it is
+    stdin on a terminal. Only a named script is mmap'd: stdin is shared
+    with the commands, so it is read through its file offset.
+
+    Returns:
+        0 on success, -1 after printing an error if script can't be opened.
+************************************************************************/
+int openLineReader(LineReader *reader, char *script){
+    reader->fd = STDIN_FILENO;
+    if (script != NULL){
+        reader->fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (reader->fd == -1){
+            perror(script);
+            return -1;
+        }
+    }
+    reader->interactive = script == NULL && isatty(reader->fd);
+
+    if (script != NULL && mapScript(reader)){
+        return 0;
+    }
+    reader->seekable = script == NULL && !reader->interactive && lseek(reader->fd, 0, SEEK_CUR) != -1;
+
+    reader->cap = READ_BUFFER_SIZE;
+    reader->buf = malloc(reader->cap + 1);
+    if (reader->buf == NULL){
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/**********************************************************************
+    Function: syncLineReader(LineReader *reader)
+
+    Hands back input read ahead of the current line before a command
+    that inherits the shell's stdin runs: the file offset is moved back
+    to just after the line, so the command reads the lines that follow
+    (as under sh) and the shell continues after whatever it consumed.
+    Does nothing unless the input is seekable.
+************************************************************************/
+void syncLineReader(LineReader *reader){
+    size_t ahead = reader->len - reader->start;
+
+    if (!reader->seekable || ahead == 0){
+        return;
+    }
+    if (lseek(reader->fd, -(off_t)ahead, SEEK_CUR) != -1){
+        reader->len = reader->start;
+        reader->eof = false;
+    }
+}
+
+/**********************************************************************
+    Function: closeLineReader(LineReader *reader)
+
+    Releases a reader opened on a file and closes the file.
+************************************************************************/
+void closeLineReader(LineReader *reader){
+    if (reader->mapped){
+        munmap(reader->buf, reader->cap + 1);
+    } else {
+        free(reader->buf);
+    }
+    close(reader->fd);
+}
+
+/**********************************************************************
+    Function: readCommandLine(reader, sigFD, jobs)
+
+    Waits for the next command line. The shell sleeps in poll() on
+    stdin and the SIGCHLD signalfd, so background children are reaped
+    and announced as soon as they finish, even while the user sits at
+    the prompt. An interactive prompt is shown again after such
+    announcements. On a terminal the line editor reads the line.
+
+    Returns:
+        The line, or NULL at end of input.
+************************************************************************/
+char *readCommandLine(LineReader *reader, int sigFD, JobTable *jobs){
+    struct pollfd fds[2] = {
+        { .fd = reader->fd, .events = POLLIN },
+        { .fd = sigFD, .events = POLLIN }
+    };
+    char *line;
+
+    // Report children that finished while the last command ran.
+    if (drainSignalFD(sigFD)){
+        reapBackground(jobs);
+    }
+
+    if (line_editor.enabled){
+        return editLine(reader, sigFD, jobs);
+    }
+
+    while ((line = nextLine(reader)) == NULL){
+        if (reader->eof){
+            return NULL;
+        }
+
+        // Case -> poll interrupted by SIGTSTP, whose handler reprints the prompt
+        if (poll(fds, 2, -1) == -1){
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN){
+            drainSignalFD(sigFD);
+            if (reapBackground(jobs) > 0 && reader->interactive){
+                printf(": ");
+            }
+            fflush(stdout);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+            fillLineReader(reader);
+        }
+    }
+    return line;
+}
+
+/**********************************************************************
+    Function: readNextLine(LineReader *reader)
+
+    Blocking version of readCommandLine for input that is consumed
+    without a prompt, such as the parallel builtin's command list.
+
+    Returns:
+        The line, or NULL at end of input.
+************************************************************************/
+char *readNextLine(LineReader *reader){
+    char *line;
+
+    while ((line = nextLine(reader)) == NULL){
+        if (reader->eof){
+            return NULL;
+        }
+        fillLineReader(reader);
+    }
+    return line;
+}
+
+/**********************************************************************
+    Function: runWorker(worker, index, jobs, *line, *failed, *lastPID, stop)
+
+    Starts the worker's next command list node, skipping any that
+    can't run (a syntax error ends the list with status 2, a failed
+    launch counts as status 1 or 127), and leaves worker->running set
+    once one is a job. When the list is finished (or stop is set) the
+    line's result is reported: a line whose last command failed is
+    printed and counted in *failed.
+************************************************************************/
+void runWorker(ParallelWorker *worker, int index, JobTable *jobs, Command *line, int *failed, int *lastPID, bool stop){
+    char *text;
+    Job *job;
+
+    if (stop){
+        worker->list.next = worker->list.nnodes;
+    }
+    while ((text = nextListNode(&worker->list, worker->status)) != NULL){
+        resetCommand(line);
+        last_exit_code = exitCode(worker->status);
+        if (parseCommand(text, line) == -1){
+            worker->status = W_EXITCODE(2, 0);
+            worker->list.next = worker->list.nnodes;
+            continue;
+        }
+        if (line->argc == 0){
+            worker->status = 0;
+            continue;
+        }
+        if (launchPipeline(line, false, NULL) == -1){
+            worker->status = W_EXITCODE(EXIT_FAILURE, 0);
+            continue;
+        }
+        job = addJob(jobs, line);
+        if (job == NULL){
+            worker->status = W_EXITCODE(127, 0);
+            continue;
+        }
+        job->pooled = true;
+        job->owner = index;
+        *lastPID = job->lastPid;
+        worker->running = true;
+        return;
+    }
+
+    // Case -> Line finished: its result is that of its last command.
+    if (WIFSIGNALED(worker->status)){
+        fprintf(stderr, "parallel: %s: terminated by signal %d\n", worker->cmdline, WTERMSIG(worker->status));
+        (*failed)++;
+    } else if (WEXITSTATUS(worker->status) != 0){
+        fprintf(stderr, "parallel: %s: exit status %d\n", worker->cmdline, WEXITSTATUS(worker->status));
+        (*failed)++;
+    }
+}
+
+/**********************************************************************
+    Function: parallelBuiltin(cmd, input, jobs, *lastPID, *lastStatus, *lastUsage)
+
+    The parallel builtin.
+        parallel [-j N] file|-
+
+    Reads command lines from file (or a "<" redirect; "-" means the
+    rest of the shell's own input up to EOF, which in a script is the
+    rest of the script) and runs them with at most N in flight, N
+    defaulting to the online CPU count. Each line is a command list
+    (;, && and || work as in the shell) given to an idle worker, which
+    launches its commands with launchPipeline and tracks them in the
+    job table like background jobs; whenever a line finishes the next
+    one is started straight away. Other background jobs that finish
+    meanwhile are announced as usual.
+
+    Commands run with SIGINT at its default, as foreground commands do.
+    If one is interrupted no further commands are started.
+
+    Afterwards one summary line is printed and the status builtin shows
+    the number of failed lines (capped at 101, as GNU parallel does),
+    the last pid launched, and the resources used by all of them.
+************************************************************************/
+void parallelBuiltin(Command *cmd, LineReader *input, JobTable *jobs, int *lastPID, int *lastStatus, Usage *lastUsage){
+    LineReader file = {};
+    LineReader *reader = input;
+    Command line = {};
+    ParallelWorker *workers;
+    char *path = cmd->redir_path_in;
+    char *text, *end;
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int running = 0, started = 0, failed = 0;
+    bool stop = false, done = false;
+    struct rusage usage;
+    int wstatus;
+    pid_t childPid;
+    Job *job;
+
+    for (int i = 1; cmd->argv[i] != NULL; i++){
+        char *arg = cmd->argv[i];
+
+        // Case -> "-j N" or "-jN": limit on commands in flight
+        if (strncmp(arg, "-j", 2) == 0){
+            arg = arg[2] ? arg + 2 : cmd->argv[++i];
+            limit = arg ? strtol(arg, &end, 10) : 0;
+            if (arg == NULL || *end != '\0' || limit < 1){
+                fprintf(stderr, "parallel: -j needs a positive number\n");
+                return;
+            }
+
+        // Case -> File of command lines
+        } else if (path == NULL){
+            path = arg;
+        } else {
+            fprintf(stderr, "usage: parallel [-j N] file|-\n");
+            return;
+        }
+    }
+    if (limit < 1){
+        limit = 1;
+    }
+
+    // Case -> No list named: refuse rather than take the rest of the input.
+    if (path == NULL){
+        fprintf(stderr, "usage: parallel [-j N] file|-\n");
+        *lastStatus = W_EXITCODE(2, 0);
+        return;
+    }
+    if (strcmp(path, "-") != 0 || cmd->redir_path_in == path){
+        if (openLineReader(&file, path) == -1){
+            *lastStatus = W_EXITCODE(EXIT_FAILURE, 0);
+            return;
+        }
+        reader = &file;
+    }
+    workers = calloc(limit, sizeof(ParallelWorker));
+    if (workers == NULL){
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    startUsage(lastUsage);
+    *lastStatus = 0;
+
+    while (1){
+        // Case -> Idle workers: give each the next job line.
+        for (int i = 0; i < limit && !stop && !done; i++){
+            ParallelWorker *worker = &workers[i];
 
+            while (!worker->running){
+                text = readNextLine(reader);
+                if (text == NULL){
+                    done = true;
+                    break;
+                }
+                if (text[0] == '#' || text[strspn(text, " \t")] == '\0'){
+                    continue;
+                }
+                started++;
+                free(worker->cmdline);
+                worker->cmdline = strdup(text);
+                worker->status = 0;
+                if (splitList(text, &worker->list) == -1){
+                    failed++;
+                    continue;
+                }
+                runWorker(worker, i, jobs, &line, &failed, lastPID, stop);
+                running += worker->running;
+            }
+        }
+        if (running == 0){
+            break;
+        }
 
-typedef struct {
-    char args[MAX_ARGS + 1][MAX_ARG_LEN + 1];
-    char redir_path_in[MAX_ARG_LEN + 1];
-    char redir_path_out[MAX_ARG_LEN + 1];
-    bool background;
-} Command;
+        // Case -> Every worker busy (or input done): wait for a child.
+        childPid = wait4(-1, &wstatus, WUNTRACED | WCONTINUED, &usage);
+        if (childPid == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("wait4()");
+            break;
+        }
 
-int foreground_only_mode = 0;
+        job = childChanged(jobs, childPid, wstatus, &usage);
+        if (job == NULL){
+            continue;
+        }
+        if (!job->pooled){
+            announceJob(job);
+            removeJob(jobs, job);
+            continue;
+        }
 
+        // Case -> A worker's command finished: run the rest of its line.
+        ParallelWorker *worker = &workers[job->owner];
+        addUsage(lastUsage, &job->usage.usage);
+        worker->status = job->status;
+        stop = stop || (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT);
+        worker->running = false;
+        running--;
+        int index = job->owner;
+        removeJob(jobs, job);
+        runWorker(worker, index, jobs, &line, &failed, lastPID, stop);
+        running += worker->running;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &lastUsage->finished);
 
-/**********************************************************************
-    Function: parseCommand(userInput string, Command *cmd):
+    printf("parallel: %d commands, %d failed, %.3fs\n", started, failed,
+            elapsedSeconds(&lastUsage->started, &lastUsage->finished));
+    *lastStatus = W_EXITCODE(failed > 101 ? 101 : failed, 0);
 
-    Parses the user's command line input into a commend struct. Handles
-    variable expansion in the case that an arg contains "$$". Arg
-    will have current PID inserted in place of "$$" in the string.
+    for (int i = 0; i < limit; i++){
+        free(workers[i].list.text);
+        free(workers[i].list.nodes);
+        free(workers[i].cmdline);
+    }
+    free(workers);
+    freeCommand(&line);
+    if (reader == &file){
+        closeLineReader(&file);
+    } else if (reader->interactive){
+        // A terminal can be read again after the EOF (Ctrl-D) that ended the list.
+        reader->eof = false;
+    }
+}
 
-    Example: (Assume PID = 917)
-        smallsh$$ => smallsh917
-        $$$exampl$$e => 917$exampl917e
-    
-    Args:
-        userInput: input that has been prescreened for comment/null inputs.
-        *cmd: Pointer to the Command struct that is being populated.
-    
-    Returns:
-        None
+/**********************************************************************
+    Function: watchClient(Server *server, int slot)
 
-************************************************************************/ 
-void parseCommand(char * input, Command *cmd){
+    Sets which events epoll reports for a client: input until it ends,
+    and writability while replies are waiting in its out buffer.
+************************************************************************/
+void watchClient(Server *server, int slot){
+    Client *client = &server->clients[slot];
+    struct epoll_event event = {
+        .events = (client->closing ? 0 : EPOLLIN) | (client->outLen > 0 ? EPOLLOUT : 0),
+        .data.u32 = slot + 2
+    };
 
-    int pid = getpid();
-    char* pidstr = NULL;
-    char* temp = NULL;
-    temp = malloc(MAX_ARG_LEN);
+    epoll_ctl(server->epollFD, EPOLL_CTL_MOD, client->fd, &event);
+}
 
-    // Get process id string to insert into variable expansions
-    pidstr = malloc(MAX_PID_LEN + 1);
-    sprintf(pidstr, "%d", pid);
+/**********************************************************************
+    Function: setClientOutput(Server *server, Client *client, int outFD, int errFD)
 
-    // Parse Commands from userInput into struct
-    char *token = NULL;
-    token = strtok(input, " ");
+    Replaces the stdout and stderr a client's commands get, closing
+    the descriptors it passed before.
+************************************************************************/
+void setClientOutput(Server *server, Client *client, int outFD, int errFD){
+    if (client->stdio[1] != server->nullFD){
+        close(client->stdio[1]);
+    }
+    if (client->stdio[2] != server->nullFD && client->stdio[2] != client->stdio[1]){
+        close(client->stdio[2]);
+    }
+    client->stdio[1] = outFD;
+    client->stdio[2] = errFD;
+}
 
-    int argNumber = 0;
+/**********************************************************************
+    Function: closeClient(Server *server, int slot)
 
-    while (token != NULL){
+    Drops a connection and returns its slot to the free list. The
+    buffers are kept for the next client in the slot.
+************************************************************************/
+void closeClient(Server *server, int slot){
+    Client *client = &server->clients[slot];
 
-        switch(token[0]){
-            
-            // Case token is ">" -> Next token is output redirect filepath
-            case '>':
-                // Get next token and save to struct
-                token = strtok(NULL, " ");
-                strcpy(cmd->redir_path_out, token);
-                break;
+    epoll_ctl(server->epollFD, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    setClientOutput(server, client, server->nullFD, server->nullFD);
+    client->fd = -1;
+    client->nextFree = server->freeHead;
+    server->freeHead = slot;
+}
 
-            // Case token is "<" -> Next token is input redirect filepath
-            case '<':
-                // Get next token and save to command struct
-                token = strtok(NULL, " ");
-                strcpy(cmd->redir_path_in, token);
-                break;
+/**********************************************************************
+    Function: replyClient(Server *server, int slot, int code)
 
-            // case token is "&" -> Process will run in background
-            case '&':
-                cmd->background = true;
-                break;
+    Sends a command's exit code as one line. Whatever the socket won't
+    take now is buffered and sent when epoll reports it writable.
+************************************************************************/
+void replyClient(Server *server, int slot, int code){
+    Client *client = &server->clients[slot];
+    char reply[16];
+    int len = snprintf(reply, sizeof(reply), "%d\n", code);
+    ssize_t sent = 0;
 
-            // case token is all other words -> Copy to args and exapand variable if necessary.
-            default:
+    if (client->outLen == 0){
+        sent = send(client->fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1){
+            if (errno != EAGAIN){
+                client->gone = true;
+                return;
+            }
+            sent = 0;
+        }
+    }
+    if (sent == len){
+        return;
+    }
 
-                /*------------------------------------------------
-                   Variable Expansion:
+    if (client->outLen + len - sent > client->outCap){
+        size_t newCap = client->outCap ? client->outCap * 2 : 256;
+        while (newCap < client->outLen + len - sent){
+            newCap *= 2;
+        }
+        char *out = realloc(client->out, newCap);
+        if (out == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        client->out = out;
+        client->outCap = newCap;
+    }
+    memcpy(client->out + client->outLen, reply + sent, len - sent);
+    client->outLen += len - sent;
+    watchClient(server, slot);
+}
 
-                   Find and replace "$$" in the argument with the 
-                   current process id.
-                -------------------------------------------------*/
+/**********************************************************************
+    Function: runClientLines(Server *server, JobTable *jobs, int slot)
 
-                // Case -> No expansion needed
-                if (!strstr(token, "$$")){
-                    strcpy(cmd->args[argNumber], token);
-                    argNumber++;
-                    break;
-                }
+    Starts the client's next command, if it has none running. Each
+    buffered line is split with splitList and its commands are run one
+    at a time through nextListNode, so ;, && and || behave as in the
+    shell. The line is answered with the exit code of its last command
+    once the list is finished. Commands that finish at once (syntax
+    errors, failed launches) move straight on. A client that has
+    finished or gone is closed once idle and its replies are sent.
 
-                // Case -> String contains $$ -> Replace with PID
-                int temp_pos = 0;
-                for (int i=0; token[i] != '\0'; i++){
+    Exit codes for commands that never ran: 2 for a syntax error, 1
+    when a redirect could not be opened, 127 when no stage could be
+    started.
+************************************************************************/
+void runClientLines(Server *server, JobTable *jobs, int slot){
+    Client *client = &server->clients[slot];
+    Command *cmd = &server->cmd;
+    size_t start = 0;
+    char *newline, *text;
+    Job *job;
 
-                    // Case -> Pointer is at beginning of $$
-                    if (token[i] == '$' && token[i + 1] == '$'){
-                        strcpy(temp + temp_pos, pidstr);
-                        temp_pos += strlen(pidstr);
-                        temp[temp_pos] = '\0';
-                        // Skip forward one in the loop to pass the next $
-                        i += 1;
+    while (!client->gone && client->job == 0){
+        text = nextListNode(&client->list, client->status);
 
-                    // Case -> Pointer is not at the end of a $$
-                    } else {
-                        strcpy(temp + temp_pos, &token[i]);
-                        temp_pos += 1;
-                        temp[temp_pos] = '\0';
-                    }
-                }
+        // Case -> List finished: answer it and split the next buffered line.
+        if (text == NULL){
+            if (client->pending){
+                replyClient(server, slot, exitCode(client->status));
+                client->pending = false;
+            }
+            newline = memchr(client->in + start, '\n', client->inLen - start);
+            if (newline == NULL){
+                break;
+            }
+            char *line = client->in + start;
 
-                // Add expanded string to args
-                strcpy(cmd->args[argNumber], temp);
-                argNumber++;
+            *newline = '\0';
+            start = newline - client->in + 1;
+            if (line[0] == '#' || line[0] == '\0'){
+                continue;
+            }
+            client->status = 0;
+            if (splitList(line, &client->list) == -1){
+                replyClient(server, slot, 2);
+                continue;
+            }
+            client->pending = true;
+            continue;
         }
 
-        // Move to next argument
-        token = strtok(NULL, " "); 
+        resetCommand(cmd);
+        last_exit_code = exitCode(client->status);
+        if (parseCommand(text, cmd) == -1){
+            client->status = W_EXITCODE(2, 0);
+            client->list.next = client->list.nnodes;
+            continue;
+        }
+        if (cmd->argc == 0){
+            client->status = 0;
+            continue;
+        }
+        if (launchPipeline(cmd, true, client->stdio) == -1){
+            client->status = W_EXITCODE(EXIT_FAILURE, 0);
+            continue;
+        }
+        job = addJob(jobs, cmd);
+        if (job == NULL){
+            client->status = W_EXITCODE(127, 0);
+            continue;
+        }
+        job->owner = slot;
+        client->job = job->id;
     }
 
-    strcpy(cmd->args[argNumber + 1], "\0");
+    memmove(client->in, client->in + start, client->inLen - start);
+    client->inLen -= start;
 
-    free(pidstr);
-    free(temp);
+    if (client->job == 0 && (client->gone || (client->closing && client->outLen == 0))){
+        closeClient(server, slot);
+    }
 }
 
 /**********************************************************************
-    Function: printCWD
-    Helper function to display the CWD for debugging
+    Function: readClient(Server *server, JobTable *jobs, int slot)
+
+    Reads what a client sent, taking any descriptors passed with it:
+    one fd becomes both stdout and stderr, two are stdout then stderr.
 ************************************************************************/
-void printCWD(void){
-    char *buf=getcwd(NULL,0);
-    printf("CWD: %s\n", buf);
-    free(buf);
-}
+void readClient(Server *server, JobTable *jobs, int slot){
+    Client *client = &server->clients[slot];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n;
 
-/**********************************************************************
- * insertPID(*PIDS, pid)
- * Add a new pid to the PIDS array
-**********************************************************************/
-void insertPID(int *PIDS, int pid){
+    // Case -> Hung up after its end of input: nothing more can be sent.
+    if (client->closing){
+        client->gone = true;
+        epoll_ctl(server->epollFD, EPOLL_CTL_DEL, client->fd, NULL);
+        runClientLines(server, jobs, slot);
+        return;
+    }
 
-    // Loop through array, set value to 0 if found
-    for(int i = 0; i < MAX_PIDS; i++){
-        if (PIDS[i] == 0){
-            PIDS[i] = pid;
-            return;
+    if (client->inCap - client->inLen < 4096){
+        size_t newCap = client->inCap ? client->inCap * 2 : 8192;
+        char *in = realloc(client->in, newCap);
+        if (in == NULL){
+            perror("realloc()");
+            exit(EXIT_FAILURE);
         }
+        client->in = in;
+        client->inCap = newCap;
     }
-}
+    iov.iov_base = client->in + client->inLen;
+    iov.iov_len = client->inCap - client->inLen;
 
-/**********************************************************************
- * printPIDS(*PIDS, pid)
- * Print the list of PIDs to the standard out. For Debugging.
-**********************************************************************/
-void printPIDS(int *PIDS){
-    printf("PID LIST: \n");
-    for(int i = 0; i < MAX_PIDS; i++){
-        if (PIDS[i] != 0){
-            printf("PIDS[%d]: %d\n", i, PIDS[i]);
+    n = recvmsg(client->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)){
+        return;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int fds[3];
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+            for (int i = 2; i < count; i++){
+                close(fds[i]);
+            }
+            if (count > 0){
+                setClientOutput(server, client, fds[0], count > 1 ? fds[1] : fds[0]);
+            }
         }
     }
-    printf("--END PID LIST--\n");
-}
 
+    // Case -> End of input: run what was received, then close.
+    if (n <= 0){
+        client->closing = true;
+        client->gone = n == -1;
+        watchClient(server, slot);
+    } else {
+        client->inLen += n;
+    }
+    runClientLines(server, jobs, slot);
+}
 
 /**********************************************************************
-  removePID(*PIDS, pid)
-  Remove a given pid from the PIDS array. Does nothing if pid is
-  not found in PIDS array.
- 
-  Args:
-    *PIDS - pointer to process ids array.
-    pid - (int) process id.
+    Function: acceptClients(Server *server)
 
-  Returns:
-    none
-**********************************************************************/
-void removePID(int *PIDS, int pid){
-    for(int i = 0; i < MAX_PIDS; i++){
-        if (PIDS[i] == pid){
-            PIDS[i] = 0;
-            return;
+    Accepts every pending connection into a free client slot, growing
+    the slot array when none is free.
+************************************************************************/
+void acceptClients(Server *server){
+    int fd;
+
+    while ((fd = accept4(server->listenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1){
+        if (server->freeHead == -1){
+            int newCap = server->cap ? server->cap * 2 : 64;
+            Client *grown = realloc(server->clients, newCap * sizeof(Client));
+            if (grown == NULL){
+                perror("realloc()");
+                exit(EXIT_FAILURE);
+            }
+            memset(grown + server->cap, 0, (newCap - server->cap) * sizeof(Client));
+            for (int i = newCap - 1; i >= server->cap; i--){
+                grown[i].nextFree = server->freeHead;
+                server->freeHead = i;
+            }
+            server->clients = grown;
+            server->cap = newCap;
         }
+
+        int slot = server->freeHead;
+        Client *client = &server->clients[slot];
+        server->freeHead = client->nextFree;
+
+        client->fd = fd;
+        client->stdio[0] = server->nullFD;
+        client->stdio[1] = server->nullFD;
+        client->stdio[2] = server->nullFD;
+        client->inLen = 0;
+        client->outLen = 0;
+        client->job = 0;
+        client->list.next = client->list.nnodes;
+        client->pending = false;
+        client->closing = false;
+        client->gone = false;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = slot + 2 };
+        epoll_ctl(server->epollFD, EPOLL_CTL_ADD, fd, &event);
     }
 }
 
 /**********************************************************************
-    Function: cd(Command *cmd)
-    Change the current working directory of smallsh.
+    Function: serveClients(char *path)
 
-    Args:
-        cmd: pointer to parsed command struct.
+    Server mode (--serve PATH). Listens on a Unix socket at path and
+    runs command lines from any number of clients with one epoll loop:
+    the listening socket, each client and a signalfd for SIGCHLD and
+    SIGTERM are all watched by one epoll instance. Commands are parsed
+    with parseCommand, started with launchPipeline and tracked in the
+    job table, so a finished child is matched to its client through
+    the pid hash.
 
-        path (CMD->args[1]): if specified as the first arg after cd in user 
-        input, change to this directory path. If cd is called without other
-        arguments, it will change to the path specified in the HOME
-        env variable.
+    Protocol: the client writes command lines; each line is answered
+    with its exit code (128 + signal when killed) followed by a newline,
+    in order. To see output, pass descriptors with SCM_RIGHTS on any
+    write: one fd is used for stdout and stderr, two for stdout and
+    stderr. They apply to commands started after they arrive. Builtins
+    are not available; stdin is /dev/null.
 
     Returns:
-        None.
-    
-    Changes:
-        PWD to HOME or path found in CMD->args[1]
-
+        Exit status for the shell once SIGTERM or SIGINT is received.
 ************************************************************************/
-void changeDir(Command *cmd){
+int serveClients(char *path){
+    Server server = { .freeHead = -1 };
+    JobTable jobs = { .freeHead = -1 };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event events[64];
+    struct rusage usage;
+    sigset_t mask;
+    int sigFD, wstatus;
+    pid_t childPid;
+    Job *job;
 
-    char* homepath;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "smallsh: socket path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
 
-    // Case -> cd without path: Change to HOME
-    if(strlen(cmd->args[1]) == 0){
-        homepath = getenv("HOME");
-        chdir(homepath);
-        return;
-    } 
-    
-    // Case -> cd with path: change to path
-    chdir(cmd->args[1]);
-    return;
-}
-    
-/**********************************************************************
-    Function: exitProgram(*PIDS)
+    server.nullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+    server.listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (server.nullFD == -1 || server.listenFD == -1 ||
+            bind(server.listenFD, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(server.listenFD, SOMAXCONN) == -1){
+        perror(path);
+        return EXIT_FAILURE;
+    }
 
-    Exits the program and any child processes that may still be running.
+    // Children are reaped through a signalfd; SIGTERM and SIGINT stop the server.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigFD = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 
-    Args:
-        Pointer to list of process ids
-************************************************************************/ 
-int exitProgram(int *PIDs){
+    server.epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (sigFD == -1 || server.epollFD == -1){
+        perror("epoll");
+        return EXIT_FAILURE;
+    }
+    struct epoll_event listenEvent = { .events = EPOLLIN, .data.u32 = 0 };
+    struct epoll_event signalEvent = { .events = EPOLLIN, .data.u32 = 1 };
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, server.listenFD, &listenEvent);
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, sigFD, &signalEvent);
 
-    // wait for remaining children and exit.
     while (1){
-        int res = wait(NULL);
-        if (res == -1){
-            printf("Exiting...\n");
-            exit(0);
-        } else {
-            printf("Process %d finished...\n", res);
+        int ready = epoll_wait(server.epollFD, events, 64, -1);
+
+        for (int i = 0; i < ready; i++){
+            uint32_t id = events[i].data.u32;
+
+            // Case -> New connections
+            if (id == 0){
+                acceptClients(&server);
+                continue;
+            }
+
+            // Case -> Signals: reap children and answer their clients, or stop.
+            if (id == 1){
+                struct signalfd_siginfo info;
+                while (read(sigFD, &info, sizeof(info)) == sizeof(info)){
+                    if (info.ssi_signo != SIGCHLD){
+                        close(server.listenFD);
+                        unlink(path);
+                        stopTrace();
+                        return EXIT_SUCCESS;
+                    }
+                }
+                while ((childPid = wait4(-1, &wstatus, WNOHANG, &usage)) > 0){
+                    job = childChanged(&jobs, childPid, wstatus, &usage);
+                    if (job == NULL){
+                        continue;
+                    }
+                    int slot = job->owner;
+                    server.clients[slot].status = job->status;
+                    removeJob(&jobs, job);
+                    server.clients[slot].job = 0;
+                    runClientLines(&server, &jobs, slot);
+                }
+                continue;
+            }
+
+            // Case -> Client traffic
+            int slot = id - 2;
+            Client *client = &server.clients[slot];
+            if (client->fd == -1){
+                continue;
+            }
+            if (events[i].events & EPOLLOUT){
+                ssize_t sent = send(client->fd, client->out, client->outLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (sent > 0){
+                    memmove(client->out, client->out + sent, client->outLen - sent);
+                    client->outLen -= sent;
+                    watchClient(&server, slot);
+                } else if (sent == -1 && errno != EAGAIN){
+                    client->gone = true;
+                }
+                runClientLines(&server, &jobs, slot);
+            }
+            if (client->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+                readClient(&server, &jobs, slot);
+            }
         }
     }
-    
 }
 
-/***********************************************************************
- Function: handle_SIGTSTP()
- 
- Displays message and toggles foreground_only_mode, which causes
- the shell to toggle foreground_only_mode, which will ignore 
- any & symbols found in subsequent user commands.
- ************************************************************************/ 
-void handle_SIGTSTP(int signo){
-    char* message_on = "Entering foreground-only mode (& is now ignored)\n:\0";
-    char* message_off = "Foreground-only mode off (& no longer ignored)\n:\0";
+/**********************************************************************
+    Function: parseSeconds(text, *seconds)
 
-    // Toggle foreground_only_mode
-    foreground_only_mode = !foreground_only_mode;
+    Parses a whole option value as a number of seconds, from 0 up to
+    INT_MAX. Anything else ("abc", "5s", "", "inf", "nan" or an
+    overflow) is rejected and *seconds is left alone.
 
-    // Send appropriate message
-    foreground_only_mode ? write(STDOUT_FILENO, message_on, 53): 
-                            write(STDOUT_FILENO, message_off, 51);
-    return;
+    Returns:
+        0, or -1 if text is not a valid number of seconds.
+************************************************************************/
+int parseSeconds(const char *text, double *seconds){
+    char *end;
+    double value;
+
+    errno = 0;
+    value = strtod(text, &end);
+    if (end == text || *end != '\0' || errno != 0 || !(value >= 0 && value <= INT_MAX)){
+        return -1;
+    }
+    *seconds = value;
+    return 0;
 }
 
+/**********************************************************************
+    Function: parseOptions(argc, argv)
+
+    Reads smallsh's command line options.
+        --launch=spawn  Launch external commands with posix_spawnp (default)
+        --launch=fork   Launch external commands with fork/execvp
+        --external-builtins  Run echo, test, printf, ... as programs
+        --exit-timeout=S  Seconds exit waits after SIGTERM before SIGKILL
+        --pipe-size=N   Set pipeline pipe capacity to N bytes
+        --serve PATH    Serve command lines on a Unix socket (serve_path)
+        script          Run commands from a file without prompting
+
+    Returns:
+        The script path, or NULL to read stdin.
+************************************************************************/
+char *parseOptions(int argc, char *argv[]){
+    char *script = NULL;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--launch=spawn") == 0){
+            launch_backend = LAUNCH_SPAWN;
+        } else if (strcmp(argv[i], "--launch=fork") == 0){
+            launch_backend = LAUNCH_FORK;
+        } else if (strcmp(argv[i], "--launch=zygote") == 0){
+            launch_backend = LAUNCH_ZYGOTE;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0){
+            trace_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--autopin") == 0){
+            auto_pin = true;
+        } else if (strcmp(argv[i], "--external-builtins") == 0){
+            external_builtins = true;
+        } else if (strncmp(argv[i], "--exit-timeout=", 15) == 0 && parseSeconds(argv[i] + 15, &exit_timeout) == 0){
+            continue;
+        } else if (strncmp(argv[i], "--pipe-size=", 12) == 0 && atoi(argv[i] + 12) > 0){
+            pipe_size = atoi(argv[i] + 12);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            serve_path = argv[++i];
+        } else if (strncmp(argv[i], "--serve=", 8) == 0){
+            serve_path = argv[i] + 8;
+        } else if (argv[i][0] != '-' && script == NULL){
+            script = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--launch=spawn|fork|zygote] [--autopin] [--external-builtins] [--exit-timeout=SECONDS] [--trace=PATH] [--pipe-size=BYTES] [--serve PATH | script]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return script;
+}
 
 /**********************************************************************
     Function: main ()
@@ -284,17 +6408,46 @@ void handle_SIGTSTP(int signo){
     commands and executes them until the user types the exit command.
 ************************************************************************/ 
 
-int main(){
-    char userInput[MAX_ARG_LEN + 1];
-    int PIDS[MAX_PIDS] = { 0 };
-    int cd;
-    int exit_command;
-    int status;
-    pid_t childPid = 0;
+int main(int argc, char *argv[]){
+    char *userInput;
+    char *script;
+    LineReader reader = {};
+    JobTable jobs = { .freeHead = -1 };
     int wstatus = 0;
+    sigset_t childMask;
+    int sigFD;
     int lastForegroundPID = 0;
     int lastForegroundStatus = 0;
+    Usage lastForegroundUsage = {};
+    bool timed;
+    struct rusage usage;
+    Command cmd = {};
+    CommandList list = {};
+
+    // Case -> Started by startZygote() as the launch helper
+    if (argc == 2 && strcmp(argv[1], "--zygote") == 0){
+        return runZygote(ZYGOTE_FD);
+    }
 
+    trace_path = getenv("SMALLSH_TRACE");
+    script = parseOptions(argc, argv);
+    cachePidString();
+    if (trace_path != NULL && trace_path[0] != '\0'){
+        openTrace(trace_path);
+    }
+    if (launch_backend == LAUNCH_ZYGOTE && startZygote() == -1){
+        launch_backend = LAUNCH_SPAWN;
+    }
+    if (serve_path != NULL){
+        return serveClients(serve_path);
+    }
+    if (openLineReader(&reader, script) == -1){
+        exit(EXIT_FAILURE);
+    }
+    if (reader.interactive){
+        openHistory();
+        openLineEditor(&reader);
+    }
 
     /*----------------------------------------------------
      Signal Handling
@@ -311,6 +6464,15 @@ int main(){
     SIGTSTP_action.sa_flags = SA_RESTART;
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    // SIGCHLD is read from a signalfd by the prompt loop instead of a handler
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, NULL);
+    sigFD = signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigFD == -1){
+        perror("signalfd()");
+        exit(EXIT_FAILURE);
+    }
 
     /*----------------------------------------------------
      Main Prompt Loop
@@ -323,58 +6485,103 @@ int main(){
 
             The user command is stored in a Command struct. If
             the user provides an input which is not a comment
-            or blank, then it is parsed to the Command struct
-            and processed.
+            or blank, it is split into a list at ;, && and ||,
+            and each command of the list that should run is
+            parsed to the Command struct and processed in turn.
+            The structs keep their storage between iterations;
+            only their lengths are reset here.
         ----------------------------------------------------------*/
-        Command cmd = {};
+        resetCommand(&cmd);
+
+        // Flushing keeps our messages ahead of child output in batch mode,
+        // and is free when nothing is buffered.
+        fflush(stdout);
+
+        // Run the rest of the current line's list before reading another line.
+        userInput = nextListNode(&list, lastForegroundStatus);
+        if (userInput == NULL){
+            // Prompt and get new command input.
+            if (reader.interactive){
+                printf(": ");
+                fflush(stdout);
+            }
+            userInput = readCommandLine(&reader, sigFD, &jobs);
+            TRACE(TRACE_READ, 0, userInput != NULL ? (int64_t)strlen(userInput) : -1);
+
+            // End of input -> Same as the exit command.
+            if (userInput == NULL){
+                exitProgram(&jobs, exitCode(lastForegroundStatus));
+            }
+
+            // Interactive lines go to the history file.
+            if (reader.interactive && userInput[0] != '\0'){
+                appendHistory(userInput);
+            }
 
-        // Clear in/out redirect paths
-        cmd.background = false;
-        for(int i = 0; cmd.redir_path_out[i] != 0; i++){
-            cmd.redir_path_out[i] = 0;
+            // Reprompt if comment or blank input, else split it into its ;, && and || list.
+            if ((userInput[0] == '#') | (userInput[0] == '\0')) {
+                goto command_prompt;
+            }
+            if (splitList(userInput, &list) == -1){
+                goto command_prompt;
+            }
+            userInput = nextListNode(&list, lastForegroundStatus);
         }
 
-        for(int i = 0; cmd.redir_path_in[i] != 0; i++){
-            cmd.redir_path_out[i] = 0;
+        // A syntax error drops the rest of the list.
+        last_exit_code = exitCode(lastForegroundStatus);
+        if (parseCommand(userInput, &cmd) == -1){
+            list.next = list.nnodes;
+            goto command_prompt;
         }
-        
-        // Prompt and get new command input
-        printf(": ");
-        fflush(stdout);
-        fgets(userInput, MAX_ARG_LEN, stdin);
-        
-        // Trim string for training /n char
-        userInput[strcspn(userInput, "\n")] = 0;
 
-        // Reprompt if comment or blank input, else parse the new command.
-        if ((userInput[0] == '#') | (userInput[0] == '\n')) {
+        // Redirects alone ("< a > b", "> b") are handled in the shell below.
+        // Reprompt if the line held nothing else (e.g. only spaces or "&")
+        if (cmd.argc == 0 && !isFileCopy(&cmd)){
             goto command_prompt;
-        } else {
-            parseCommand(userInput, &cmd);
         }
 
         /*-------------------------------------------------------
          Handle built in commands
-           cd, exit, and status
+           cd, exit, status, jobs, wait, kill, hash, export,
+           unset, parallel and history
 
            These commands are handled in the main process rather
-           than by forking to a child process.
+           than by forking to a child process. Inside a pipeline
+           the names are run as ordinary commands.
         --------------------------------------------------------*/
-        // CD -> Change directories. Default is HOME
-        cd = strncmp(cmd.args[0], "cd", 2);
-        if(cd == 0 && strlen(cmd.args[0]) == 2){
-            changeDir(&cmd);
-        }
+        bool builtin = cmd.nstages == 1 && cmd.argc > 0;
 
-        // Exit -> Wait for child processes and exit.
-        exit_command = strncmp(cmd.args[0], "exit", 4);
-        if(exit_command == 0 && strlen(cmd.args[0]) == 4){
-            exitProgram(PIDS);
+        // "time cmd ..." runs cmd and reports its resource usage afterwards.
+        timed = builtin && strcmp(cmd.argv[0], "time") == 0 && cmd.argv[1] != NULL;
+        if (timed){
+            cmd.stages[0]++;
+            builtin = false;
         }
 
-        // Status -> Prints status of child process.
-        status = strncmp(cmd.args[0], "status", 6);
-        if(status == 0 && strlen(cmd.args[0]) == 6){
+        // CD -> Change directories. Default is HOME
+        if(builtin && strcmp(cmd.argv[0], "cd") == 0){
+            lastForegroundStatus = W_EXITCODE(changeDir(&cmd) == 0 ? 0 : EXIT_FAILURE, 0);
+
+        // Exit -> Wait for child processes and exit with [n] or the last status.
+        } else if(builtin && strcmp(cmd.argv[0], "exit") == 0){
+            int code = exitCode(lastForegroundStatus);
+
+            // Case -> "exit n": n must be a whole number, as in sh.
+            if (cmd.argv[1] != NULL){
+                char *end;
+
+                errno = 0;
+                code = strtol(cmd.argv[1], &end, 10);
+                if (end == cmd.argv[1] || *end != '\0' || errno != 0){
+                    fprintf(stderr, "exit: %s: numeric argument required\n", cmd.argv[1]);
+                    code = 2;
+                }
+            }
+            exitProgram(&jobs, code);
+
+        // Status -> Prints status of child process, with its resource usage for -v.
+        } else if(builtin && strcmp(cmd.argv[0], "status") == 0){
             // Case -> Child has exited
             if(WIFEXITED(lastForegroundStatus)){
                 printf("Last foreground process, pid %d, exited with status %d\n", 
@@ -384,203 +6591,157 @@ int main(){
                 printf("The processed received a signal: %d\n", 
                         WTERMSIG(lastForegroundStatus));
             }
-        }
+            if (cmd.argv[1] != NULL && strcmp(cmd.argv[1], "-v") == 0){
+                printUsage(stdout, &lastForegroundUsage);
+            }
 
-        /*-------------------------------------------------------
-         Handle other commands
-         If the user enters a command other than cd, exit, or
-         status, the shell will try to execute the command
-         from the HOME directory in a new child process.
-        --------------------------------------------------------*/
+        // Jobs -> Lists background jobs.
+        } else if(builtin && strcmp(cmd.argv[0], "jobs") == 0){
+            printJobs(&jobs);
 
-        // Other commands
-        if (cd != 0 && exit_command != 0 && status != 0){
-            // Fork child process
-            childPid = fork();
+        // Wait -> Blocks until background jobs finish.
+        } else if(builtin && strcmp(cmd.argv[0], "wait") == 0){
+            waitBuiltin(&cmd, &jobs, &lastForegroundPID, &lastForegroundStatus, &lastForegroundUsage);
 
-            switch(childPid){
+        // Kill -> Signals background jobs or pids.
+        } else if(builtin && strcmp(cmd.argv[0], "kill") == 0){
+            killBuiltin(&cmd, &jobs);
 
-                // Case -> Fork error
-                case -1:
-                    perror("fork() failed.");
-                    // exit(1);
-                    break;
+        // Hash -> Shows or edits the command location cache.
+        } else if(builtin && strcmp(cmd.argv[0], "hash") == 0){
+            hashBuiltin(&cmd);
 
-                // Case -> Child Process
-                case 0:;
+        // Export/Unset -> Sets, exports or removes variables; NAME=value sets one.
+        } else if(builtin && strcmp(cmd.argv[0], "export") == 0){
+            exportBuiltin(&cmd);
+        } else if(builtin && strcmp(cmd.argv[0], "unset") == 0){
+            unsetBuiltin(&cmd);
+        } else if(builtin && isAssignmentLine(&cmd)){
+            assignVariables(&cmd);
 
-                    /*--------------------------------------------------------------------
-                      Signal Handling For Child Processes:
-                        1. SIGINT (Child is Background): Ignore (Inherited from Parent)
-                        2. SIGINT (Child is Foreground): Default (Set here)
-                        3. SIGTSP (All Children): Ignore (Set here)
-                    ---------------------------------------------------------------------*/
+        // History -> Lists or searches earlier command lines.
+        } else if(builtin && strcmp(cmd.argv[0], "history") == 0){
+            historyBuiltin(&cmd);
 
-                    // Ignore SIGTSTP
-                    SIGTSTP_action.sa_handler = SIG_IGN;
-                    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+        // Parallel -> Runs a list of commands, N at a time.
+        } else if(builtin && strcmp(cmd.argv[0], "parallel") == 0){
+            parallelBuiltin(&cmd, &reader, &jobs, &lastForegroundPID, &lastForegroundStatus, &lastForegroundUsage);
 
-                    // Set Default Handling for SIG_INT if this is a foreground process only.
-                    if(cmd.background == false){
-                        SIGINT_action.sa_handler = SIG_DFL;
-                        sigaction(SIGINT, &SIGINT_action, NULL);
-                    }
+        /*-------------------------------------------------------
+         File copies
+           "cat < a > b", "cat a > b" and "< a > b" are done by
+           the shell with copy_file_range instead of a child.
+        --------------------------------------------------------*/
+        } else if(isFileCopy(&cmd)){
+            runFileCopy(&cmd, &lastForegroundPID, &lastForegroundStatus, &lastForegroundUsage);
+            if (timed){
+                printUsage(stderr, &lastForegroundUsage);
+            }
 
+        /*-------------------------------------------------------
+         Fast builtins
+           echo, true, false, pwd, test, [ and printf run in the
+           shell with their redirects swapped onto its stdin and
+           stdout, unless --external-builtins was given.
+        --------------------------------------------------------*/
+        } else if(isFastBuiltin(&cmd)){
+            runFastBuiltin(&cmd, &lastForegroundPID, &lastForegroundStatus, &lastForegroundUsage);
+            if (timed){
+                printUsage(stderr, &lastForegroundUsage);
+            }
 
-                    /*--------------------------------------------------------------------
-                      Prepare arguments for execvp()
-                        1. Arguments must be array of pointers
-                        2. Last arg must be null pointer
-                        3. First arg must be name of command (Example: ls)
-                        4. Subsequent args follow the command (Example: -al)
-                    ---------------------------------------------------------------------*/
-                
-                    // Create list of pointers to arg strings with Null terminator at end.
-                    char *newargv[513] = {};
-                    for (int i=0;i<513;i++){
-                        if(strcmp(cmd.args[i], "") == 0){
-                            newargv[i] = NULL;
-                        } else {
-                            newargv[i] = cmd.args[i];
-                        }
-                    }
-                    newargv[512] = NULL;
-
-                    /*-------------------------------------------------
-                     Handle Redirects and execute.
-
-                     The symbols for redirect (<, >) have been parsed 
-                     out of the args already. The filepaths have also 
-                     been parsed out and saved in the cmd struct.
-
-                     Here this information is used to redirect the
-                     stdin and stdout streams prior to calling execvp.
-                    -------------------------------------------------*/
-                    int targetFD;
-                    int sourceFD;
-                    int result;
-
-                    // Case -> Redirect Input found in command.
-                    if(cmd.redir_path_in[0] != 0){
-                        // Open source file if found
-                        sourceFD = open(cmd.redir_path_in, O_RDONLY);
-                        if (sourceFD == -1) { 
-                            perror("source open()"); 
-                            exit(EXIT_FAILURE); 
-	                    }
-
-                        // Redirect the Input stream (0) to the sourceFD
-                        result = dup2(sourceFD, 0);
-                        if (result == -1){
-                            perror("target dup2() - Source");
-                            exit(EXIT_FAILURE);
-                        }
+        /*-------------------------------------------------------
+         Handle other commands
+         If the user enters a command other than a builtin, the
+         shell will try to execute the command
+         from the HOME directory in a new child process.
+        --------------------------------------------------------*/
+        // Other commands
+        } else {
+            bool background = cmd.background && !foreground_only_mode;
+            pid_t lastPid;
 
-                    }
+            // Launch every stage with the selected backend
+            startUsage(&lastForegroundUsage);
+            if (cmd.redir_path_in == NULL){
+                syncLineReader(&reader);
+            }
+            if (launchPipeline(&cmd, background, NULL) == -1){
+                // Case -> Redirect failed: foreground status matches a child exiting 1
+                if (!background){
+                    lastForegroundStatus = W_EXITCODE(EXIT_FAILURE, 0);
+                }
+                goto command_prompt;
+            }
+            lastPid = cmd.pids[cmd.nstages - 1];
 
-                    // Handle Redirect Output if needed
-                    if(cmd.redir_path_out[0] != 0){
-                        // Create or open output file specified by redirect out path.
-                        targetFD = open(cmd.redir_path_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                        if (targetFD == -1) { 
-                            perror("target open()"); 
-                            exit(EXIT_FAILURE); 
-                        } else {
-                            printf("File sucessfully made.");
-                        }
+            /*-----------------------------------------------
+            Parent Process
 
-                        // Redirect stdout (stream 1) to the redirect out file.
-                        result = dup2(targetFD, 1);
-                        if (result == -1){
-                            perror("target dup2() - Destination");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
+            The parent handles logic for waiting and 
+            monitoring of the children here. When the
+            pipeline is complete or if it was a non-blocking
+            background job, the parent returns control of
+            the program to the user.
+            ------------------------------------------------*/
 
-                    // Execute the command
-                    execvp(newargv[0], newargv);
-                    perror("Execvp");
-                    exit(EXIT_FAILURE);
-
-                /*-----------------------------------------------
-                Case -> Default: Parent Process
-
-                The parent handles logic for waiting and 
-                monitoring of the child process here. When the
-                child process is complete or if the process was
-                a non-blocking background process, the parent
-                returns control of the program to the user.
-                ------------------------------------------------*/
-                default:
-
-                    /*--------------------------------------------
-                    Case 1: Child Process is Foreground
-
-                    This type of process is called when a user
-                    does not use the & symbol in their command.
-                    The parent will wait until the process
-                    is complete before returning control to the
-                    user (blocking).
-                    ----------------------------------------------*/
-                    if ((cmd.background == 0) | (foreground_only_mode == 1)){
-                        lastForegroundPID = childPid;
-                        childPid = waitpid(childPid, &wstatus, 0);
-                        lastForegroundStatus = wstatus;
-
-                        // Indicate if child was terminated by a signal
-                        if (WIFSIGNALED(wstatus)){
-                            printf("\nChild process was terminated by signal: %d\n", WTERMSIG(wstatus));
+            /*--------------------------------------------
+            Case 1: Child Process is Foreground
+
+            This type of process is called when a user
+            does not use the & symbol in their command.
+            The parent will wait until every stage
+            is complete before returning control to the
+            user (blocking). Status comes from the last
+            stage; rusage is summed over all of them.
+            ----------------------------------------------*/
+            if (!background){
+                lastForegroundPID = lastPid;
+                lastForegroundStatus = W_EXITCODE(EXIT_FAILURE, 0);
+                for (int i = 0; i < cmd.nstages; i++){
+                    if (cmd.pids[i] != -1){
+                        wait4(cmd.pids[i], &wstatus, 0, &usage);
+                        TRACE(TRACE_REAP, cmd.pids[i], wstatus);
+                        addUsage(&lastForegroundUsage, &usage);
+                        if (i == cmd.nstages - 1){
                             lastForegroundStatus = wstatus;
                         }
                     }
+                }
+                clock_gettime(CLOCK_MONOTONIC, &lastForegroundUsage.finished);
+                if (cmd.limits.cgroup[0] != '\0'){
+                    rmdir(cmd.limits.cgroup);
+                }
 
-                    /*--------------------------------------------
-                    Case 2: Child Process is Background
-
-                    This type of process is called when a user
-                    includes the & symbol in their command. The
-                    child process does not block, but instead
-                    runs in the background and control of the
-                    program is returned to the user immediately.
-                    ----------------------------------------------*/
-                    if ((cmd.background == 1) && (foreground_only_mode == 0)){
-                        // Announce and add to PID list for tracking.
-                        printf("Executing child process %d in the background.\n", childPid);
-                        insertPID(PIDS, childPid);
-                    }
+                if (timed){
+                    printUsage(stderr, &lastForegroundUsage);
+                }
 
+                // Indicate if child was terminated by a signal
+                if (WIFSIGNALED(lastForegroundStatus)){
+                    printf("\nChild process was terminated by signal: %d\n", WTERMSIG(lastForegroundStatus));
+                }
+            }
 
-                    /*--------------------------------------------------------
-                     After any new command (blocking or non):
-                        1. Check every PID in list using waitpid( WNOHANG )
-
-                        2. If childPid returned is not 0, announce that
-                        the process has finished and explain why it exited.
-                        This could be termination by reaching end of process
-                        or termination by signal.
-
-                        3. Remove any completed process ids from the tracking
-                        array.
-                    ---------------------------------------------------------*/
-                    for(int i = 0; i < MAX_PIDS; i++){
-                        if (PIDS[i] != 0){
-                            childPid = waitpid(PIDS[i], &wstatus, WNOHANG);
-
-                            // If Child has completed, announce status and remove from PIDS
-                            if(childPid != 0){
-                                if(WIFEXITED(wstatus)){
-                                    printf("Background process, pid %d, exited with status %d\n", childPid, WEXITSTATUS(wstatus));
-                                } else if (WIFSIGNALED(wstatus)){
-                                    printf("The background process, pid %d, was terminated by signal: %d\n", childPid, WTERMSIG(wstatus));
-                                }
-                                removePID(PIDS, childPid);
-                            }
-                        }
-                    }
+            /*--------------------------------------------
+            Case 2: Child Process is Background
 
-                    // End of Parent Process -> Control returns to the user via command_prompt loop.
-                    break;
+            This type of process is called when a user
+            includes the & symbol in their command. The
+            child process does not block, but instead
+            runs in the background and control of the
+            program is returned to the user immediately.
+            ----------------------------------------------*/
+            if (background){
+                // Announce and add to the job table for tracking.
+                if (lastPid != -1){
+                    printf("Executing child process %d in the background.\n", lastPid);
+                    last_background_pid = lastPid;
+                }
+                addJob(&jobs, &cmd);
             }
+
+            // End of Parent Process -> Control returns to the user via command_prompt loop.
         }
     }
     